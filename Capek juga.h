@@ -3,46 +3,7 @@
 
 #include <inttypes.h>
 #include "Arduino.h"
-
-typedef struct
-{
-    uint8_t u8id;          /*!< Slave address between 1 and 247. 0 means broadcast */
-    uint8_t u8fct;         /*!< Function code: 1, 2, 3, 4, 5, 6, 15 or 16 */
-    uint16_t u16RegAdd;    /*!< Address of the first register to access at slave/s */
-    uint16_t u16CoilsNo;   /*!< Number of coils or registers to access */
-    uint16_t *au16reg;     /*!< Pointer to memory image in master */
-} modbus_t;
-
-enum
-{
-    RESPONSE_SIZE = 6,
-    EXCEPTION_SIZE = 3,
-    CHECKSUM_SIZE = 2
-};
-
-enum MESSAGE
-{
-    ID = 0, //!< ID field
-    FUNC, //!< Function code position
-    ADD_HI, //!< Address high byte
-    ADD_LO, //!< Address low byte
-    NB_HI, //!< Number of coils or registers high byte
-    NB_LO, //!< Number of coils or registers low byte
-    BYTE_CNT  //!< byte counter
-};
-
-enum MB_FC
-{
-    MB_FC_NONE = 0,   /*!< null operator */
-    MB_FC_READ_COILS = 1, /*!< FCT=1 -> read coils or digital outputs */
-    MB_FC_READ_DISCRETE_INPUT = 2, /*!< FCT=2 -> read digital inputs */
-    MB_FC_READ_REGISTERS = 3, /*!< FCT=3 -> read registers or analog outputs */
-    MB_FC_READ_INPUT_REGISTER = 4, /*!< FCT=4 -> read analog inputs */
-    MB_FC_WRITE_COIL = 5, /*!< FCT=5 -> write single coil or output */
-    MB_FC_WRITE_REGISTER = 6, /*!< FCT=6 -> write single register */
-    MB_FC_WRITE_MULTIPLE_COILS = 15, /*!< FCT=15 -> write multiple coils or outputs */
-    MB_FC_WRITE_MULTIPLE_REGISTERS = 16 /*!< FCT=16 -> write multiple registers */
-};
+#include "ModbusCore.h"
 
 enum COM_STATES
 {
@@ -50,116 +11,86 @@ enum COM_STATES
     COM_WAITING = 1
 };
 
-enum ERR_LIST
-{
-    ERR_NOT_MASTER = -1,
-    ERR_POLLING = -2,
-    ERR_BUFF_OVERFLOW = -3,
-    ERR_BAD_CRC = -4,
-    ERR_EXCEPTION = -5
-};
+#define MAX_BUFFER  64 //!< maximum size for the communication buffer in bytes
 
-enum
-{
-    NO_REPLY = 255,
-    EXC_FUNC_CODE = 1,
-    EXC_ADDR_RANGE = 2,
-    EXC_REGS_QUANT = 3,
-    EXC_EXECUTE = 4
-};
+struct Modbus;
 
-const unsigned char fctsupported[] =
+/**
+ * RS-485 direction control: transmit before the first byte, receive once
+ * the last stop bit is out. NULL entries are skipped.
+ */
+typedef struct ModbusDir
 {
-    MB_FC_READ_COILS,
-    MB_FC_READ_DISCRETE_INPUT,
-    MB_FC_READ_REGISTERS,
-    MB_FC_READ_INPUT_REGISTER,
-    MB_FC_WRITE_COIL,
-    MB_FC_WRITE_REGISTER,
-    MB_FC_WRITE_MULTIPLE_COILS,
-    MB_FC_WRITE_MULTIPLE_REGISTERS
-};
+    void (*transmit)(struct Modbus *modbus);
+    void (*receive)(struct Modbus *modbus);
+} ModbusDir;
 
-#define T35  5
-#define MAX_BUFFER  64 //!< maximum size for the communication buffer in bytes
+extern const ModbusDir ModbusDir_none;     //!< USB or RS-232, no direction line
+extern const ModbusDir ModbusDir_pin;      //!< digitalWrite on u8txenpin > 1, HIGH while sending (default)
+extern const ModbusDir ModbusDir_callback; //!< calls the function given to Modbus_setDirCallback()
 
-typedef struct
+typedef struct Modbus
 {
     Stream *port; //!< Pointer to Stream class object (Either HardwareSerial or SoftwareSerial)
     uint8_t u8id; //!< 0=master, 1..247=slave number
     uint8_t u8txenpin; //!< flow control pin: 0=USB or RS-232 mode, >1=RS-485 mode
+    const ModbusDir *dir; //!< RS-485 direction backend
+    void (*dirCallback)(struct Modbus *modbus, bool bTransmit); //!< for ModbusDir_callback
     uint8_t u8state;
     uint8_t u8lastError;
     uint8_t au8Buffer[MAX_BUFFER];
     uint8_t u8BufferSize;
-    uint8_t u8lastRec;
+    modbus_rx_t rx; //!< frame being received into au8Buffer
     uint16_t *au16regs;
+    uint16_t u16queryNo; //!< coils or registers the pending query reads into au16regs
     uint16_t u16InCnt, u16OutCnt, u16errCnt;
     uint16_t u16timeOut;
     uint32_t u32time, u32timeOut, u32overTime;
+    uint32_t u32T35; //!< inter-frame silence in us
+    uint32_t u32char; //!< time of one 11-bit character in us
+    uint32_t u32txStart, u32txTime; //!< start and duration of the frame being sent in us
+    uint8_t u8txLength; //!< bytes of the frame being sent, at most this much echo is dropped
+    bool bTxBusy; //!< frame still on the line, direction not yet released
     uint8_t u8regsize;
 } Modbus;
 
-void Modbus_init(Modbus *modbus, uint8_t u8id, Stream *port, uint8_t u8txenpin)
-{
-    modbus->u8id = u8id;
-    modbus->port = port;
-    modbus->u8txenpin = u8txenpin;
-    modbus->u8state = COM_IDLE;
-    modbus->u8lastError = 0;
-    modbus->u8BufferSize = 0;
-    modbus->u16InCnt = 0;
-    modbus->u16OutCnt = 0;
-    modbus->u16errCnt = 0;
-    modbus->u16timeOut = 1000; // default timeout
-}
-
-void Modbus_start(Modbus *modbus)
-{
-    // Start the Modbus communication
-    modbus->u8state = COM_WAITING;
-}
-
-void Modbus_setTimeOut(Modbus *modbus, uint16_t u16timeOut)
-{
-    modbus->u16timeOut = u16timeOut;
-}
-
-uint16_t Modbus_getTimeOut(Modbus *modbus)
-{
-    return modbus->u16timeOut;
-}
-
-uint8_t Modbus_getID(Modbus *modbus)
-{
-    return modbus->u8id;
-}
-
-void Modbus_setID(Modbus *modbus, uint8_t u8id)
-{
-    modbus->u8id = u8id;
-}
-
-uint16_t Modbus_getInCnt(Modbus *modbus)
-{
-    return modbus->u16InCnt;
-}
-
-uint16_t Modbus_getOutCnt(Modbus *modbus)
-{
-    return modbus->u16OutCnt;
-}
-
-uint16_t Modbus_getErrCnt(Modbus *modbus)
-{
-    return modbus->u16errCnt;
-}
-
-uint8_t Modbus_getLastError(Modbus *modbus)
-{
-    return modbus->u8lastError;
-}
-
-// Additional functions for processing Modbus requests, sending buffers, etc., need to be implemented
+void Modbus_init(Modbus *modbus, uint8_t u8id, Stream *port, uint8_t u8txenpin);
+void Modbus_init_deprecated(Modbus *modbus, uint8_t u8id, uint8_t u8serno, uint8_t u8txenpin);
+void Modbus_start(Modbus *modbus);
+void Modbus_setBaudRate(Modbus *modbus, long u32speed); //!<derive T3.5 from the line speed
+void Modbus_begin(Modbus *modbus, Stream *install_port, long u32speed);
+void Modbus_begin_with_txen(Modbus *modbus, Stream *install_port, long u32speed, uint8_t u8txenpin);
+void Modbus_begin_hw(Modbus *modbus, long u32speed);
+void Modbus_setID(Modbus *modbus, uint8_t u8id); //!<write new ID for the slave
+void Modbus_setTxendPinOverTime(Modbus *modbus, uint32_t u32overTime); //!<extra us after the last stop bit before the line is released
+void Modbus_setDirNone(Modbus *modbus); //!<no direction line, e.g. USB or RS-232
+void Modbus_setDirCallback(Modbus *modbus, void (*callback)(struct Modbus *modbus, bool bTransmit)); //!<drive the direction line from user code
+uint8_t Modbus_getID(Modbus *modbus); //!<get slave ID between 1 and 247
+void Modbus_setTimeOut(Modbus *modbus, uint16_t u16timeOut); //!<write communication watch-dog timer
+uint16_t Modbus_getTimeOut(Modbus *modbus); //!<get communication watch-dog timer value
+uint8_t Modbus_getTimeOutState(Modbus *modbus); //!<get communication watch-dog timer state
+uint16_t Modbus_getInCnt(Modbus *modbus); //!<number of incoming messages
+uint16_t Modbus_getOutCnt(Modbus *modbus); //!<number of outcoming messages
+uint16_t Modbus_getErrCnt(Modbus *modbus); //!<error counter
+uint8_t Modbus_getState(Modbus *modbus);
+uint8_t Modbus_getLastError(Modbus *modbus); //!<get last error message
+int8_t Modbus_query(Modbus *modbus, modbus_t telegram); //!<only for master
+int8_t Modbus_poll(Modbus *modbus); //!<cyclic poll for master
+int8_t Modbus_poll_slave(Modbus *modbus, uint16_t *regs, uint8_t u8size); //!<cyclic poll for slave
+
+int8_t Modbus_getRxBuffer(Modbus *modbus);
+void Modbus_sendTxBuffer(Modbus *modbus);
+uint16_t Modbus_calcCRC(Modbus *modbus, uint8_t u8length);
+uint8_t Modbus_validateAnswer(Modbus *modbus);
+uint8_t Modbus_validateRequest(Modbus *modbus);
+void Modbus_buildException(Modbus *modbus, uint8_t u8exception);
+void Modbus_get_FC1(Modbus *modbus);
+void Modbus_get_FC3(Modbus *modbus);
+int8_t Modbus_process_FC1(Modbus *modbus, uint16_t *regs, uint8_t u8size);
+int8_t Modbus_process_FC3(Modbus *modbus, uint16_t *regs, uint8_t u8size);
+int8_t Modbus_process_FC5(Modbus *modbus, uint16_t *regs, uint8_t u8size);
+int8_t Modbus_process_FC6(Modbus *modbus, uint16_t *regs, uint8_t u8size);
+int8_t Modbus_process_FC15(Modbus *modbus, uint16_t *regs, uint8_t u8size);
+int8_t Modbus_process_FC16(Modbus *modbus, uint16_t *regs, uint8_t u8size);
 
 #endif // MODBUS_RTU_H
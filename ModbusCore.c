@@ -0,0 +1,534 @@
+#include "ModbusCore.h"
+#include "ModbusCrc.h"
+#include "ModbusRegs.h"
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__AVR__)
+#include <avr/pgmspace.h>
+#define FCT_TABLE PROGMEM
+#define FCT_READ(entry) pgm_read_byte(&(entry))
+#else
+#define FCT_TABLE
+#define FCT_READ(entry) (entry)
+#endif
+
+typedef struct
+{
+    uint8_t (*check)(const modbus_access_t *access, void *ctx, uint8_t u8bank, const uint8_t *au8frame, uint16_t u16length);
+    uint16_t (*process)(const modbus_access_t *access, void *ctx, uint8_t u8bank, uint8_t *au8frame);
+    uint8_t u8bank; //!< bank served, see BANKS
+}
+fct_entry_t;
+
+static uint16_t core_word(const uint8_t *au8frame, uint8_t u8pos)
+{
+    return (uint16_t)((au8frame[u8pos] << 8) | au8frame[u8pos + 1]);
+}
+
+static bool core_isBits(uint8_t u8bank)
+{
+    return (u8bank == BANK_COILS || u8bank == BANK_DISCRETE);
+}
+
+/* _____REQUEST CHECKS_______________________________________________________ */
+
+static uint8_t check_readBits(const modbus_access_t *access, void *ctx, uint8_t u8bank, const uint8_t *au8frame, uint16_t u16length)
+{
+    (void)u16length;
+    uint16_t u16no = core_word(au8frame, NB_HI);
+    if (u16no == 0 || u16no > MAX_READ_COILS) return EXC_REGS_QUANT;
+    if (!access->exists(ctx, u8bank, core_word(au8frame, ADD_HI), u16no)) return EXC_ADDR_RANGE;
+    return 0;
+}
+
+static uint8_t check_readRegs(const modbus_access_t *access, void *ctx, uint8_t u8bank, const uint8_t *au8frame, uint16_t u16length)
+{
+    (void)u16length;
+    uint16_t u16no = core_word(au8frame, NB_HI);
+    if (u16no == 0 || u16no > MAX_READ_REGISTERS) return EXC_REGS_QUANT;
+    if (!access->exists(ctx, u8bank, core_word(au8frame, ADD_HI), u16no)) return EXC_ADDR_RANGE;
+    return 0;
+}
+
+static uint8_t check_writeOne(const modbus_access_t *access, void *ctx, uint8_t u8bank, const uint8_t *au8frame, uint16_t u16length)
+{
+    (void)u16length;
+    if (!access->exists(ctx, u8bank, core_word(au8frame, ADD_HI), 1)) return EXC_ADDR_RANGE;
+    return 0;
+}
+
+static uint8_t check_writeBits(const modbus_access_t *access, void *ctx, uint8_t u8bank, const uint8_t *au8frame, uint16_t u16length)
+{
+    uint16_t u16no = core_word(au8frame, NB_HI);
+    if (u16no == 0 || u16no > MAX_WRITE_COILS) return EXC_REGS_QUANT;
+    if (au8frame[BYTE_CNT] != (u16no + 7) / 8) return EXC_REGS_QUANT;
+    if (u16length < (uint16_t)(BYTE_CNT + 1 + au8frame[BYTE_CNT] + CHECKSUM_SIZE)) return EXC_REGS_QUANT;
+    if (!access->exists(ctx, u8bank, core_word(au8frame, ADD_HI), u16no)) return EXC_ADDR_RANGE;
+    return 0;
+}
+
+static uint8_t check_writeRegs(const modbus_access_t *access, void *ctx, uint8_t u8bank, const uint8_t *au8frame, uint16_t u16length)
+{
+    uint16_t u16no = core_word(au8frame, NB_HI);
+    if (u16no == 0 || u16no > MAX_WRITE_REGISTERS) return EXC_REGS_QUANT;
+    if (au8frame[BYTE_CNT] != u16no * 2) return EXC_REGS_QUANT;
+    if (u16length < (uint16_t)(BYTE_CNT + 1 + au8frame[BYTE_CNT] + CHECKSUM_SIZE)) return EXC_REGS_QUANT;
+    if (!access->exists(ctx, u8bank, core_word(au8frame, ADD_HI), u16no)) return EXC_ADDR_RANGE;
+    return 0;
+}
+
+static uint8_t check_maskWrite(const modbus_access_t *access, void *ctx, uint8_t u8bank, const uint8_t *au8frame, uint16_t u16length)
+{
+    if (u16length < MASK_SIZE + CHECKSUM_SIZE) return EXC_REGS_QUANT;
+    if (!access->exists(ctx, u8bank, core_word(au8frame, ADD_HI), 1)) return EXC_ADDR_RANGE;
+    return 0;
+}
+
+static uint8_t check_readWriteRegs(const modbus_access_t *access, void *ctx, uint8_t u8bank, const uint8_t *au8frame, uint16_t u16length)
+{
+    uint16_t u16no = core_word(au8frame, NB_HI);
+    uint16_t u16writeNo = core_word(au8frame, RW_WRITE_NB_HI);
+
+    if (u16length < RW_BYTE_CNT + 1 + CHECKSUM_SIZE) return EXC_REGS_QUANT;
+    if (u16no == 0 || u16no > MAX_RW_READ_REGISTERS) return EXC_REGS_QUANT;
+    if (u16writeNo == 0 || u16writeNo > MAX_RW_WRITE_REGISTERS) return EXC_REGS_QUANT;
+    if (au8frame[RW_BYTE_CNT] != u16writeNo * 2) return EXC_REGS_QUANT;
+    if (u16length < (uint16_t)(RW_BYTE_CNT + 1 + au8frame[RW_BYTE_CNT] + CHECKSUM_SIZE)) return EXC_REGS_QUANT;
+    if (!access->exists(ctx, u8bank, core_word(au8frame, ADD_HI), u16no)) return EXC_ADDR_RANGE;
+    if (!access->exists(ctx, u8bank, core_word(au8frame, RW_WRITE_ADD_HI), u16writeNo)) return EXC_ADDR_RANGE;
+    return 0;
+}
+
+/* _____ANSWERS______________________________________________________________ */
+
+static uint16_t process_readBits(const modbus_access_t *access, void *ctx, uint8_t u8bank, uint8_t *au8frame)
+{
+    uint16_t u16add = core_word(au8frame, ADD_HI);
+    uint16_t u16no = core_word(au8frame, NB_HI);
+    uint8_t u8bytesno = (uint8_t)((u16no + 7) / 8);
+
+    au8frame[2] = u8bytesno;
+    access->read(ctx, u8bank, &au8frame[3], u16add, u16no);
+    return 3 + u8bytesno;
+}
+
+static uint16_t process_readRegs(const modbus_access_t *access, void *ctx, uint8_t u8bank, uint8_t *au8frame)
+{
+    uint16_t u16add = core_word(au8frame, ADD_HI);
+    uint16_t u16no = core_word(au8frame, NB_HI);
+
+    au8frame[2] = (uint8_t)(u16no * 2);
+    access->read(ctx, u8bank, &au8frame[3], u16add, u16no);
+    return 3 + u16no * 2;
+}
+
+static uint16_t process_writeCoil(const modbus_access_t *access, void *ctx, uint8_t u8bank, uint8_t *au8frame)
+{
+    uint8_t u8bit = (au8frame[NB_HI] == 0xff) ? 1 : 0;
+    access->write(ctx, u8bank, core_word(au8frame, ADD_HI), &u8bit, 1);
+    return RESPONSE_SIZE; // echo of the request
+}
+
+static uint16_t process_writeReg(const modbus_access_t *access, void *ctx, uint8_t u8bank, uint8_t *au8frame)
+{
+    access->write(ctx, u8bank, core_word(au8frame, ADD_HI), &au8frame[NB_HI], 1);
+    return RESPONSE_SIZE;
+}
+
+static uint16_t process_writeBits(const modbus_access_t *access, void *ctx, uint8_t u8bank, uint8_t *au8frame)
+{
+    access->write(ctx, u8bank, core_word(au8frame, ADD_HI), &au8frame[BYTE_CNT + 1], core_word(au8frame, NB_HI));
+    return RESPONSE_SIZE;
+}
+
+static uint16_t process_writeRegs(const modbus_access_t *access, void *ctx, uint8_t u8bank, uint8_t *au8frame)
+{
+    uint16_t u16no = core_word(au8frame, NB_HI);
+
+    access->write(ctx, u8bank, core_word(au8frame, ADD_HI), &au8frame[BYTE_CNT + 1], u16no);
+    au8frame[NB_HI] = 0;
+    au8frame[NB_LO] = (uint8_t)u16no;
+    return RESPONSE_SIZE;
+}
+
+static uint16_t process_maskWrite(const modbus_access_t *access, void *ctx, uint8_t u8bank, uint8_t *au8frame)
+{
+    (void)u8bank;
+    access->mask(ctx, core_word(au8frame, ADD_HI),
+                 core_word(au8frame, MASK_AND_HI), core_word(au8frame, MASK_OR_HI));
+    return MASK_SIZE; // echo of the request
+}
+
+static uint16_t process_readWriteRegs(const modbus_access_t *access, void *ctx, uint8_t u8bank, uint8_t *au8frame)
+{
+    uint16_t u16readAdd = core_word(au8frame, ADD_HI);
+    uint16_t u16readNo = core_word(au8frame, NB_HI);
+
+    // the write happens first, so the read sees the new values; the answer
+    // overwrites the request only after the write data has been consumed
+    access->write(ctx, u8bank, core_word(au8frame, RW_WRITE_ADD_HI),
+                  &au8frame[RW_BYTE_CNT + 1], core_word(au8frame, RW_WRITE_NB_HI));
+    au8frame[2] = (uint8_t)(u16readNo * 2);
+    access->read(ctx, u8bank, &au8frame[3], u16readAdd, u16readNo);
+    return 3 + u16readNo * 2;
+}
+
+/* _____FUNCTION CODE DISPATCH_______________________________________________ */
+
+// slot of each function code in afct[], 0 = not built in
+static const uint8_t au8FctSlot[256] FCT_TABLE =
+{
+    0, 1, 2, 3, 4, 5, 6, 0, 0, 0, 0, 0, 0, 0, 0, 7,
+    8, 0, 0, 0, 0, 0, 9, 10, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+static const fct_entry_t afct[] =
+{
+    { NULL, NULL, BANK_HOLDING },
+    { check_readBits, process_readBits, BANK_COILS },              // FC1
+    { check_readBits, process_readBits, BANK_DISCRETE },           // FC2
+    { check_readRegs, process_readRegs, BANK_HOLDING },            // FC3
+    { check_readRegs, process_readRegs, BANK_INPUT },              // FC4
+    { check_writeOne, process_writeCoil, BANK_COILS },             // FC5
+    { check_writeOne, process_writeReg, BANK_HOLDING },            // FC6
+    { check_writeBits, process_writeBits, BANK_COILS },            // FC15
+    { check_writeRegs, process_writeRegs, BANK_HOLDING },          // FC16
+    { check_maskWrite, process_maskWrite, BANK_HOLDING },          // FC22
+    { check_readWriteRegs, process_readWriteRegs, BANK_HOLDING }   // FC23
+};
+
+static const fct_entry_t *core_fct(uint8_t u8fct)
+{
+    uint8_t u8slot = FCT_READ(au8FctSlot[u8fct]);
+    return (u8slot != 0) ? &afct[u8slot] : NULL;
+}
+
+/* _____FLAT REGISTER ARRAY__________________________________________________ */
+
+static bool flat_exists(void *ctx, uint8_t u8bank, uint16_t u16add, uint32_t u32count)
+{
+    const modbus_flat_t *flat = (const modbus_flat_t *)ctx;
+    if (core_isBits(u8bank)) return ((uint32_t)u16add + u32count <= (uint32_t)flat->u16regs * 16); // coils alias the registers
+    return ((uint32_t)u16add + u32count <= flat->u16regs);
+}
+
+static void flat_read(void *ctx, uint8_t u8bank, uint8_t *au8dst, uint16_t u16add, uint16_t u16count)
+{
+    const modbus_flat_t *flat = (const modbus_flat_t *)ctx;
+    if (core_isBits(u8bank)) ModbusBits_pack(au8dst, flat->au16regs, u16add, u16count);
+    else ModbusRegs_pack(au8dst, &flat->au16regs[u16add], u16count);
+}
+
+static void flat_write(void *ctx, uint8_t u8bank, uint16_t u16add, const uint8_t *au8src, uint16_t u16count)
+{
+    const modbus_flat_t *flat = (const modbus_flat_t *)ctx;
+    if (core_isBits(u8bank)) ModbusBits_unpack(flat->au16regs, u16add, au8src, u16count);
+    else ModbusRegs_unpack(&flat->au16regs[u16add], au8src, u16count);
+}
+
+static void flat_mask(void *ctx, uint16_t u16add, uint16_t u16and, uint16_t u16or)
+{
+    uint16_t *reg = &((const modbus_flat_t *)ctx)->au16regs[u16add];
+    *reg = (*reg & u16and) | (u16or & ~u16and);
+}
+
+const modbus_access_t ModbusCore_flat = { flat_exists, flat_read, flat_write, flat_mask };
+
+/* _____PUBLIC FUNCTIONS_____________________________________________________ */
+
+void ModbusCore_timing(uint32_t u32speed, uint32_t *pu32T35, uint32_t *pu32char)
+{
+    if (u32speed == 0) return;
+
+    // an RTU character is 11 bits long: start, 8 data, parity/stop, stop
+    if (u32speed > 19200)
+    {
+        *pu32T35 = T35_US_MIN;
+    }
+    else
+    {
+        *pu32T35 = 38500000UL / u32speed;
+    }
+    *pu32char = (11000000UL + u32speed - 1) / u32speed;
+}
+
+void ModbusCore_rxBegin(modbus_rx_t *rx)
+{
+    rx->u16length = 0;
+    rx->u16crc = MODBUS_CRC_INIT;
+    rx->u8state = RX_RECEIVING;
+}
+
+static bool core_rxComplete(modbus_rx_t *rx, const uint8_t *au8frame)
+{
+    // master: the answer is complete as soon as its predicted length checks out
+    if (rx->u16expected == 0 || rx->u16crc != MODBUS_CRC_RESIDUE) return false;
+    if (rx->u16length != rx->u16expected &&
+        !(rx->u16length == EXCEPTION_SIZE + CHECKSUM_SIZE && (au8frame[FUNC] & 0x80))) return false;
+    rx->u8state = RX_IDLE;
+    return true;
+}
+
+bool ModbusCore_rxByte(modbus_rx_t *rx, uint8_t *au8frame, uint16_t u16size, uint8_t u8byte)
+{
+    if (rx->u8state != RX_RECEIVING) return false;
+    if (rx->u16length >= u16size)
+    {
+        rx->u8state = RX_DISCARD;
+        return false;
+    }
+    au8frame[rx->u16length] = u8byte;
+    rx->u16crc = ModbusCRC_byte(rx->u16crc, u8byte);
+    rx->u16length++;
+    return core_rxComplete(rx, au8frame);
+}
+
+bool ModbusCore_rxPut(modbus_rx_t *rx, uint8_t *au8frame, uint16_t u16size, const uint8_t *au8data, uint16_t u16count)
+{
+    uint16_t i;
+
+    // a predicted answer may end inside the block: bytes behind it are dropped
+    if (rx->u16expected != 0)
+    {
+        for (i = 0; i < u16count; i++)
+        {
+            if (ModbusCore_rxByte(rx, au8frame, u16size, au8data[i])) return true;
+        }
+        return false;
+    }
+
+    if (rx->u8state != RX_RECEIVING) return false;
+    if (u16count > u16size - rx->u16length)
+    {
+        rx->u8state = RX_DISCARD;
+        return false;
+    }
+    memcpy(&au8frame[rx->u16length], au8data, u16count);
+    rx->u16crc = ModbusCRC_update(rx->u16crc, au8data, u16count);
+    rx->u16length += u16count;
+    return false;
+}
+
+int16_t ModbusCore_rxEnd(modbus_rx_t *rx)
+{
+    bool bOverflow = (rx->u8state == RX_DISCARD);
+
+    rx->u8state = RX_IDLE;
+    if (bOverflow)
+    {
+        rx->u16length = 0;
+        return ERR_BUFF_OVERFLOW;
+    }
+    return (int16_t)rx->u16length;
+}
+
+uint16_t ModbusCore_seal(uint8_t *au8frame, uint16_t u16length)
+{
+    uint16_t u16crc = ModbusCRC_update(MODBUS_CRC_INIT, au8frame, u16length);
+
+    // the CRC travels low byte first
+    au8frame[u16length] = (uint8_t)(u16crc & 0x00ff);
+    au8frame[u16length + 1] = (uint8_t)(u16crc >> 8);
+    return u16length + CHECKSUM_SIZE;
+}
+
+uint16_t ModbusCore_exception(uint8_t *au8frame, uint8_t u8id, uint8_t u8exception)
+{
+    au8frame[ID] = u8id;
+    au8frame[FUNC] += 0x80;
+    au8frame[2] = u8exception;
+    return EXCEPTION_SIZE;
+}
+
+int16_t ModbusCore_query(uint8_t *au8frame, uint16_t u16size, const modbus_t *telegram, uint16_t *pu16expected)
+{
+    uint16_t u16length = RESPONSE_SIZE;
+    uint16_t u16expected = RESPONSE_SIZE; // write functions echo address and quantity
+    uint16_t u16bytesno;
+
+    au8frame[ID] = telegram->u8id;
+    au8frame[FUNC] = telegram->u8fct;
+    au8frame[ADD_HI] = (uint8_t)(telegram->u16RegAdd >> 8);
+    au8frame[ADD_LO] = (uint8_t)(telegram->u16RegAdd & 0xff);
+    au8frame[NB_HI] = (uint8_t)(telegram->u16CoilsNo >> 8);
+    au8frame[NB_LO] = (uint8_t)(telegram->u16CoilsNo & 0xff);
+
+    switch (telegram->u8fct)
+    {
+    case MB_FC_READ_COILS:
+    case MB_FC_READ_DISCRETE_INPUT:
+        if (telegram->u16CoilsNo > MAX_READ_COILS) return ERR_BAD_TELEGRAM;
+        u16expected = 3 + (telegram->u16CoilsNo + 7) / 8;
+        break;
+    case MB_FC_READ_REGISTERS:
+    case MB_FC_READ_INPUT_REGISTER:
+        if (telegram->u16CoilsNo > MAX_READ_REGISTERS) return ERR_BAD_TELEGRAM;
+        u16expected = 3 + telegram->u16CoilsNo * 2;
+        break;
+    case MB_FC_WRITE_COIL:
+        au8frame[NB_HI] = ((telegram->au16reg[0] > 0) ? 0xff : 0);
+        au8frame[NB_LO] = 0;
+        break;
+    case MB_FC_WRITE_REGISTER:
+        au8frame[NB_HI] = (uint8_t)(telegram->au16reg[0] >> 8);
+        au8frame[NB_LO] = (uint8_t)(telegram->au16reg[0] & 0xff);
+        break;
+    case MB_FC_WRITE_MULTIPLE_COILS:
+        if (telegram->u16CoilsNo > MAX_WRITE_COILS) return ERR_BAD_TELEGRAM;
+        u16bytesno = (telegram->u16CoilsNo + 7) / 8;
+        if (BYTE_CNT + 1 + u16bytesno + CHECKSUM_SIZE > u16size) return ERR_BAD_TELEGRAM;
+        au8frame[BYTE_CNT] = (uint8_t)u16bytesno;
+        // coil 0 is bit 0 of au16reg[0], the first coil on the wire
+        ModbusBits_pack(&au8frame[BYTE_CNT + 1], telegram->au16reg, 0, telegram->u16CoilsNo);
+        u16length = BYTE_CNT + 1 + u16bytesno;
+        break;
+    case MB_FC_WRITE_MULTIPLE_REGISTERS:
+        if (telegram->u16CoilsNo > MAX_WRITE_REGISTERS) return ERR_BAD_TELEGRAM;
+        if (BYTE_CNT + 1 + telegram->u16CoilsNo * 2 + CHECKSUM_SIZE > u16size) return ERR_BAD_TELEGRAM;
+        au8frame[BYTE_CNT] = (uint8_t)(telegram->u16CoilsNo * 2);
+        ModbusRegs_pack(&au8frame[BYTE_CNT + 1], telegram->au16reg, telegram->u16CoilsNo);
+        u16length = BYTE_CNT + 1 + telegram->u16CoilsNo * 2;
+        break;
+    case MB_FC_MASK_WRITE_REGISTER:
+        au8frame[MASK_AND_HI] = (uint8_t)(telegram->au16reg[0] >> 8);
+        au8frame[MASK_AND_LO] = (uint8_t)(telegram->au16reg[0] & 0xff);
+        au8frame[MASK_OR_HI] = (uint8_t)(telegram->au16reg[1] >> 8);
+        au8frame[MASK_OR_LO] = (uint8_t)(telegram->au16reg[1] & 0xff);
+        u16length = MASK_SIZE;
+        u16expected = MASK_SIZE; // the slave echoes the request
+        break;
+    case MB_FC_READ_WRITE_REGISTERS:
+        if (telegram->u16CoilsNo > MAX_RW_READ_REGISTERS) return ERR_BAD_TELEGRAM;
+        if (telegram->u16WriteNo > MAX_RW_WRITE_REGISTERS) return ERR_BAD_TELEGRAM;
+        if (RW_BYTE_CNT + 1 + telegram->u16WriteNo * 2 + CHECKSUM_SIZE > u16size) return ERR_BAD_TELEGRAM;
+        au8frame[RW_WRITE_ADD_HI] = (uint8_t)(telegram->u16WriteAdd >> 8);
+        au8frame[RW_WRITE_ADD_LO] = (uint8_t)(telegram->u16WriteAdd & 0xff);
+        au8frame[RW_WRITE_NB_HI] = (uint8_t)(telegram->u16WriteNo >> 8);
+        au8frame[RW_WRITE_NB_LO] = (uint8_t)(telegram->u16WriteNo & 0xff);
+        au8frame[RW_BYTE_CNT] = (uint8_t)(telegram->u16WriteNo * 2);
+        ModbusRegs_pack(&au8frame[RW_BYTE_CNT + 1], telegram->au16write, telegram->u16WriteNo);
+        u16length = RW_BYTE_CNT + 1 + telegram->u16WriteNo * 2;
+        u16expected = 3 + telegram->u16CoilsNo * 2;
+        break;
+    default:
+        // user function code: address and quantity, the answer ends on silence
+        u16expected = 0;
+        break;
+    }
+
+    // an answer that does not fit could only end as an overflow
+    if (u16expected != 0 && u16expected + CHECKSUM_SIZE > u16size) return ERR_BAD_TELEGRAM;
+    *pu16expected = (u16expected != 0) ? u16expected + CHECKSUM_SIZE : 0;
+    return (int16_t)u16length;
+}
+
+uint8_t ModbusCore_checkAnswer(const modbus_rx_t *rx, const uint8_t *au8frame)
+{
+    // the CRC was accumulated while receiving; a sound frame leaves no residue
+    if (rx->u16crc != MODBUS_CRC_RESIDUE) return (uint8_t)ERR_BAD_CRC;
+    if ((au8frame[FUNC] & 0x80) != 0) return (uint8_t)ERR_EXCEPTION;
+    if (!ModbusCore_isBuiltin(au8frame[FUNC])) return EXC_FUNC_CODE;
+
+    switch (au8frame[FUNC])
+    {
+    case MB_FC_READ_COILS:
+    case MB_FC_READ_DISCRETE_INPUT:
+    case MB_FC_READ_REGISTERS:
+    case MB_FC_READ_INPUT_REGISTER:
+    case MB_FC_READ_WRITE_REGISTERS:
+        // the byte count must describe this very frame before it is copied out
+        if (rx->u16length != 3 + au8frame[2] + CHECKSUM_SIZE) return (uint8_t)ERR_BAD_SIZE;
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+int8_t ModbusCore_getAnswer(const uint8_t *au8frame, uint16_t *au16regs, uint16_t u16quantity)
+{
+    // the image holds what was asked for: any other byte count is refused
+    switch (au8frame[FUNC])
+    {
+    case MB_FC_READ_COILS:
+    case MB_FC_READ_DISCRETE_INPUT:
+        if (au8frame[2] != (u16quantity + 7) / 8) return ERR_BAD_SIZE;
+        // whole answer bytes land in the image, coil 0 in bit 0 of au16regs[0]
+        ModbusBits_unpack(au16regs, 0, &au8frame[3], au8frame[2] * 8);
+        break;
+    case MB_FC_READ_REGISTERS:
+    case MB_FC_READ_INPUT_REGISTER:
+    case MB_FC_READ_WRITE_REGISTERS:
+        if (au8frame[2] != u16quantity * 2) return ERR_BAD_SIZE;
+        ModbusRegs_unpack(au16regs, &au8frame[3], u16quantity);
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+bool ModbusCore_isBuiltin(uint8_t u8fct)
+{
+    return core_fct(u8fct) != NULL;
+}
+
+uint8_t ModbusCore_bank(uint8_t u8fct)
+{
+    const fct_entry_t *fct = core_fct(u8fct);
+    return (fct != NULL) ? fct->u8bank : BANK_HOLDING;
+}
+
+uint8_t ModbusCore_checkRequest(const modbus_access_t *access, void *ctx, const uint8_t *au8frame, uint16_t u16length, uint16_t u16size)
+{
+    const fct_entry_t *fct = core_fct(au8frame[FUNC]);
+    uint16_t u16no;
+    uint32_t u32answer = RESPONSE_SIZE;
+
+    if (fct == NULL) return EXC_FUNC_CODE;
+    if (u16length < RESPONSE_SIZE + CHECKSUM_SIZE) return NO_REPLY; // too short to carry address and quantity
+
+    // the answer is built in place: it has to fit the frame buffer too
+    u16no = core_word(au8frame, NB_HI);
+    switch (au8frame[FUNC])
+    {
+    case MB_FC_READ_COILS:
+    case MB_FC_READ_DISCRETE_INPUT:
+        u32answer = 3 + (u16no + 7) / 8;
+        break;
+    case MB_FC_READ_REGISTERS:
+    case MB_FC_READ_INPUT_REGISTER:
+    case MB_FC_READ_WRITE_REGISTERS:
+        u32answer = 3 + (uint32_t)u16no * 2;
+        break;
+    case MB_FC_MASK_WRITE_REGISTER:
+        u32answer = MASK_SIZE;
+        break;
+    default:
+        break;
+    }
+    if (u32answer + CHECKSUM_SIZE > u16size) return EXC_REGS_QUANT;
+
+    return fct->check(access, ctx, fct->u8bank, au8frame, u16length);
+}
+
+uint16_t ModbusCore_process(const modbus_access_t *access, void *ctx, uint8_t *au8frame)
+{
+    const fct_entry_t *fct = core_fct(au8frame[FUNC]);
+    return fct->process(access, ctx, fct->u8bank, au8frame);
+}
@@ -0,0 +1,197 @@
+#ifndef MODBUS_CORE_H
+#define MODBUS_CORE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Modbus RTU protocol core shared by the C++ class and the C ports.
+ *
+ * Pure functions over a caller-owned frame buffer and a small receive
+ * state: framing, CRC, request and answer encoding, validation and
+ * function code handling. No heap, no I/O and no clock; the bindings
+ * move bytes, keep time and decide when a frame has ended.
+ *
+ * Slave data is reached through a modbus_access_t table, so flat
+ * arrays, typed banks and sparse maps share the same FC handling.
+ */
+
+typedef struct
+{
+    uint8_t u8id;          /*!< Slave address between 1 and 247. 0 means broadcast */
+    uint8_t u8fct;         /*!< Function code: 1, 2, 3, 4, 5, 6, 15, 16, 22 or 23 */
+    uint16_t u16RegAdd;    /*!< Address of the first register to access at slave/s */
+    uint16_t u16CoilsNo;   /*!< Number of coils or registers to access */
+    uint16_t *au16reg;     /*!< Pointer to memory image in master; FC22: AND mask, OR mask */
+    uint16_t u16WriteAdd;  /*!< FC23: address of the first register to write */
+    uint16_t u16WriteNo;   /*!< FC23: number of registers to write */
+    uint16_t *au16write;   /*!< FC23: registers to write; au16reg receives the read */
+}
+modbus_t;
+
+enum
+{
+    RESPONSE_SIZE = 6,
+    EXCEPTION_SIZE = 3,
+    CHECKSUM_SIZE = 2
+};
+
+enum MESSAGE
+{
+    ID                             = 0, //!< ID field
+    FUNC, //!< Function code position
+    ADD_HI, //!< Address high byte
+    ADD_LO, //!< Address low byte
+    NB_HI, //!< Number of coils or registers high byte
+    NB_LO, //!< Number of coils or registers low byte
+    BYTE_CNT  //!< byte counter
+};
+
+enum MESSAGE_RW
+{
+    RW_WRITE_ADD_HI                = 6, //!< FC23 write address high byte
+    RW_WRITE_ADD_LO, //!< FC23 write address low byte
+    RW_WRITE_NB_HI, //!< FC23 number of registers to write high byte
+    RW_WRITE_NB_LO, //!< FC23 number of registers to write low byte
+    RW_BYTE_CNT  //!< FC23 write byte counter
+};
+
+enum MESSAGE_MASK
+{
+    MASK_AND_HI                    = 4, //!< FC22 AND mask high byte
+    MASK_AND_LO, //!< FC22 AND mask low byte
+    MASK_OR_HI, //!< FC22 OR mask high byte
+    MASK_OR_LO, //!< FC22 OR mask low byte
+    MASK_SIZE  //!< FC22 request and answer length without CRC
+};
+
+enum MB_FC
+{
+    MB_FC_NONE                     = 0,   /*!< null operator */
+    MB_FC_READ_COILS               = 1,	/*!< FCT=1 -> read coils or digital outputs */
+    MB_FC_READ_DISCRETE_INPUT      = 2,	/*!< FCT=2 -> read digital inputs */
+    MB_FC_READ_REGISTERS           = 3,	/*!< FCT=3 -> read registers or analog outputs */
+    MB_FC_READ_INPUT_REGISTER      = 4,	/*!< FCT=4 -> read analog inputs */
+    MB_FC_WRITE_COIL               = 5,	/*!< FCT=5 -> write single coil or output */
+    MB_FC_WRITE_REGISTER           = 6,	/*!< FCT=6 -> write single register */
+    MB_FC_WRITE_MULTIPLE_COILS     = 15,	/*!< FCT=15 -> write multiple coils or outputs */
+    MB_FC_WRITE_MULTIPLE_REGISTERS = 16,	/*!< FCT=16 -> write multiple registers */
+    MB_FC_MASK_WRITE_REGISTER      = 22,	/*!< FCT=22 -> AND/OR mask write of one register */
+    MB_FC_READ_WRITE_REGISTERS     = 23	/*!< FCT=23 -> write then read multiple registers */
+};
+
+enum RX_STATES
+{
+    RX_IDLE                      = 0, //!< no frame in progress
+    RX_RECEIVING                 = 1, //!< bytes are being collected into the frame buffer
+    RX_DISCARD                   = 2  //!< frame overflowed, drop bytes until T3.5 silence
+};
+
+enum ERR_LIST
+{
+    ERR_NOT_MASTER                = -1, //!< query() on a slave
+    ERR_POLLING                   = -2, //!< query() while a transaction is pending
+    ERR_BUFF_OVERFLOW             = -3, //!< received frame longer than the buffer
+    ERR_BAD_CRC                   = -4, //!< received frame failed the CRC check
+    ERR_EXCEPTION                 = -5, //!< slave answered with an exception
+    ERR_QUARANTINED               = -6, //!< slave is backing off, query() not sent
+    ERR_BAD_TELEGRAM              = -7, //!< quantity over the Modbus limit or answer larger than the buffer
+    ERR_BAD_SIZE                  = -8  //!< answer too short or its byte count does not match the frame
+};
+
+enum
+{
+    NO_REPLY = 255,
+    EXC_FUNC_CODE = 1,
+    EXC_ADDR_RANGE = 2,
+    EXC_REGS_QUANT = 3,
+    EXC_EXECUTE = 4
+};
+
+enum
+{
+    MAX_READ_COILS                 = 2000, //!< FC1/FC2 quantity limit
+    MAX_READ_REGISTERS             = 125,  //!< FC3/FC4 quantity limit
+    MAX_WRITE_COILS                = 1968, //!< FC15 quantity limit
+    MAX_WRITE_REGISTERS            = 123,  //!< FC16 quantity limit
+    MAX_RW_READ_REGISTERS          = 125,  //!< FC23 read quantity limit
+    MAX_RW_WRITE_REGISTERS         = 121   //!< FC23 write quantity limit
+};
+
+enum BANKS
+{
+    BANK_COILS                   = 0,
+    BANK_DISCRETE                = 1,
+    BANK_INPUT                   = 2,
+    BANK_HOLDING                 = 3
+};
+
+#define T35  5           //!< default inter-frame silence in ms until the baud rate is known
+#define T35_US_MIN  1750 //!< fixed T3.5 in us above 19200 baud
+
+/* Receive state of one frame. The bytes live in the caller's buffer;
+ * the CRC is accumulated as they arrive, so a complete frame is checked
+ * against MODBUS_CRC_RESIDUE without a second pass. */
+typedef struct
+{
+    uint16_t u16length;    /*!< Bytes stored in the frame buffer */
+    uint16_t u16crc;       /*!< CRC over those bytes */
+    uint16_t u16expected;  /*!< Master: predicted answer length with CRC, 0 = T3.5 ends the frame */
+    uint8_t u8state;       /*!< See RX_STATES */
+}
+modbus_rx_t;
+
+/* Slave data behind the core. Bits travel LSB first and registers high
+ * byte first, exactly as on the wire; u8bank is one of BANKS. */
+typedef struct
+{
+    bool (*exists)( void *ctx, uint8_t u8bank, uint16_t u16add, uint32_t u32count ); //!< every coil or register is addressable
+    void (*read)( void *ctx, uint8_t u8bank, uint8_t *au8dst, uint16_t u16add, uint16_t u16count ); //!< pack into the answer
+    void (*write)( void *ctx, uint8_t u8bank, uint16_t u16add, const uint8_t *au8src, uint16_t u16count ); //!< unpack from the request
+    void (*mask)( void *ctx, uint16_t u16add, uint16_t u16and, uint16_t u16or ); //!< FC22 read-modify-write of one holding register
+}
+modbus_access_t;
+
+/* One register array serving every bank; coil n is bit n%16 of word n/16 */
+typedef struct
+{
+    uint16_t *au16regs;
+    uint16_t u16regs;
+}
+modbus_flat_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern const modbus_access_t ModbusCore_flat; //!< access table for a modbus_flat_t context
+
+void ModbusCore_timing(uint32_t u32speed, uint32_t *pu32T35, uint32_t *pu32char); //!< T3.5 and one 11-bit character in us
+
+/* receive: rxBegin at the first byte of a frame, rxByte/rxPut for every
+ * byte (true once a predicted answer is complete), rxEnd after T3.5 of
+ * silence. A frame longer than u16size is dropped as a whole. */
+void ModbusCore_rxBegin(modbus_rx_t *rx);
+bool ModbusCore_rxByte(modbus_rx_t *rx, uint8_t *au8frame, uint16_t u16size, uint8_t u8byte);
+bool ModbusCore_rxPut(modbus_rx_t *rx, uint8_t *au8frame, uint16_t u16size, const uint8_t *au8data, uint16_t u16count);
+int16_t ModbusCore_rxEnd(modbus_rx_t *rx); //!< frame length or ERR_BUFF_OVERFLOW
+
+uint16_t ModbusCore_seal(uint8_t *au8frame, uint16_t u16length); //!< append the CRC, returns the new length
+uint16_t ModbusCore_exception(uint8_t *au8frame, uint8_t u8id, uint8_t u8exception); //!< exception answer to the request in au8frame
+
+/* master */
+int16_t ModbusCore_query(uint8_t *au8frame, uint16_t u16size, const modbus_t *telegram, uint16_t *pu16expected); //!< request without CRC or ERR_BAD_TELEGRAM
+uint8_t ModbusCore_checkAnswer(const modbus_rx_t *rx, const uint8_t *au8frame); //!< 0, EXC_FUNC_CODE or ERR_BAD_CRC, ERR_EXCEPTION, ERR_BAD_SIZE as uint8_t
+int8_t ModbusCore_getAnswer(const uint8_t *au8frame, uint16_t *au16regs, uint16_t u16quantity); //!< copy read data to the master image, 0 or ERR_BAD_SIZE
+
+/* slave; u16length counts the received frame with its CRC, u16size is the
+ * capacity of au8frame: reads whose answer would not fit are refused */
+bool ModbusCore_isBuiltin(uint8_t u8fct);
+uint8_t ModbusCore_bank(uint8_t u8fct); //!< bank served by a built-in function code
+uint8_t ModbusCore_checkRequest(const modbus_access_t *access, void *ctx, const uint8_t *au8frame, uint16_t u16length, uint16_t u16size); //!< 0 or exception
+uint16_t ModbusCore_process(const modbus_access_t *access, void *ctx, uint8_t *au8frame); //!< answer in place, length without CRC
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MODBUS_CORE_H
@@ -0,0 +1,54 @@
+#ifndef MODBUS_CRC_H
+#define MODBUS_CRC_H
+
+#include <stdint.h>
+
+/* CRC-16/Modbus engine shared by the C++ class and the C ports.
+ *
+ * All strategies compute the same reflected CRC (poly 0xA001, init 0xFFFF);
+ * they only trade table size for speed:
+ *   MODBUS_CRC_BITWISE   no table,        8 shift/xor steps per byte
+ *   MODBUS_CRC_NIBBLE    32 byte table,   2 lookups per byte
+ *   MODBUS_CRC_TABLE     512 byte table,  1 lookup per byte
+ *   MODBUS_CRC_SLICE8    4 KiB table,     8 bytes per iteration
+ *
+ * Override with -DMODBUS_CRC_STRATEGY=... ; on AVR the tables live in flash.
+ */
+#define MODBUS_CRC_BITWISE  0
+#define MODBUS_CRC_NIBBLE   1
+#define MODBUS_CRC_TABLE    2
+#define MODBUS_CRC_SLICE8   3
+
+#ifndef MODBUS_CRC_STRATEGY
+#if defined(__AVR__)
+#define MODBUS_CRC_STRATEGY MODBUS_CRC_NIBBLE
+#else
+#define MODBUS_CRC_STRATEGY MODBUS_CRC_SLICE8
+#endif
+#endif
+
+#define MODBUS_CRC_INIT 0xFFFF //!< initial CRC register value
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Each function continues u16crc over u16length bytes and returns the raw
+ * CRC register: low byte goes first on the wire. */
+uint16_t ModbusCRC_bitwise(uint16_t u16crc, const uint8_t *au8data, uint16_t u16length);
+uint16_t ModbusCRC_nibble(uint16_t u16crc, const uint8_t *au8data, uint16_t u16length);
+uint16_t ModbusCRC_table(uint16_t u16crc, const uint8_t *au8data, uint16_t u16length);
+uint16_t ModbusCRC_slice8(uint16_t u16crc, const uint8_t *au8data, uint16_t u16length);
+
+uint16_t ModbusCRC_update(uint16_t u16crc, const uint8_t *au8data, uint16_t u16length); //!< compile-time selected strategy
+uint16_t ModbusCRC_byte(uint16_t u16crc, uint8_t u8data); //!< single byte step of the selected strategy
+
+/* Running the CRC over a whole frame, including its own two CRC bytes,
+ * leaves this residue when the frame is intact. */
+#define MODBUS_CRC_RESIDUE 0x0000
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MODBUS_CRC_H
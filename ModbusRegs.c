@@ -0,0 +1,165 @@
+#include "ModbusRegs.h"
+#include <string.h>
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#define REGS_BIG_ENDIAN 1
+#else
+#define REGS_BIG_ENDIAN 0
+#endif
+
+/* _____PUBLIC FUNCTIONS_____________________________________________________ */
+
+void ModbusRegs_pack_scalar(uint8_t *au8dst, const uint16_t *au16src, uint16_t u16count)
+{
+    uint16_t i;
+    for (i = 0; i < u16count; i++)
+    {
+        au8dst[2 * i]     = (uint8_t)(au16src[i] >> 8);
+        au8dst[2 * i + 1] = (uint8_t)(au16src[i] & 0xFF);
+    }
+}
+
+void ModbusRegs_unpack_scalar(uint16_t *au16dst, const uint8_t *au8src, uint16_t u16count)
+{
+    uint16_t i;
+    for (i = 0; i < u16count; i++)
+    {
+        au16dst[i] = ((uint16_t)au8src[2 * i] << 8) | au8src[2 * i + 1];
+    }
+}
+
+/* memcpy keeps the unaligned frame access legal; compilers turn it and the
+ * swap into a single load/rev16/store (ARM) or a register move pair (AVR). */
+static inline uint16_t regs_swap(uint16_t u16value)
+{
+#if REGS_BIG_ENDIAN
+    return u16value;
+#elif defined(__GNUC__)
+    return __builtin_bswap16(u16value);
+#else
+    return (uint16_t)((u16value << 8) | (u16value >> 8));
+#endif
+}
+
+void ModbusRegs_pack_swap(uint8_t *au8dst, const uint16_t *au16src, uint16_t u16count)
+{
+    uint16_t i, u16value;
+    for (i = 0; i < u16count; i++)
+    {
+        u16value = regs_swap(au16src[i]);
+        memcpy(au8dst + 2 * i, &u16value, 2);
+    }
+}
+
+void ModbusRegs_unpack_swap(uint16_t *au16dst, const uint8_t *au8src, uint16_t u16count)
+{
+    uint16_t i, u16value;
+    for (i = 0; i < u16count; i++)
+    {
+        memcpy(&u16value, au8src + 2 * i, 2);
+        au16dst[i] = regs_swap(u16value);
+    }
+}
+
+#if defined(__SSSE3__)
+/* pack and unpack are the same byte-pair swap, only the pointer types differ */
+static void regs_shuffle(uint8_t *au8dst, const uint8_t *au8src, uint16_t u16count)
+{
+    const __m128i swap = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    while (u16count >= 8)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *)au8src);
+        _mm_storeu_si128((__m128i *)au8dst, _mm_shuffle_epi8(block, swap));
+        au8src += 16;
+        au8dst += 16;
+        u16count -= 8;
+    }
+    while (u16count--)
+    {
+        au8dst[0] = au8src[1];
+        au8dst[1] = au8src[0];
+        au8src += 2;
+        au8dst += 2;
+    }
+}
+
+void ModbusRegs_pack_ssse3(uint8_t *au8dst, const uint16_t *au16src, uint16_t u16count)
+{
+    regs_shuffle(au8dst, (const uint8_t *)au16src, u16count);
+}
+
+void ModbusRegs_unpack_ssse3(uint16_t *au16dst, const uint8_t *au8src, uint16_t u16count)
+{
+    regs_shuffle((uint8_t *)au16dst, au8src, u16count);
+}
+#endif
+
+void ModbusRegs_pack(uint8_t *au8dst, const uint16_t *au16src, uint16_t u16count)
+{
+#if MODBUS_REGS_STRATEGY == MODBUS_REGS_SSSE3
+    ModbusRegs_pack_ssse3(au8dst, au16src, u16count);
+#elif MODBUS_REGS_STRATEGY == MODBUS_REGS_SWAP
+    ModbusRegs_pack_swap(au8dst, au16src, u16count);
+#else
+    ModbusRegs_pack_scalar(au8dst, au16src, u16count);
+#endif
+}
+
+void ModbusRegs_unpack(uint16_t *au16dst, const uint8_t *au8src, uint16_t u16count)
+{
+#if MODBUS_REGS_STRATEGY == MODBUS_REGS_SSSE3
+    ModbusRegs_unpack_ssse3(au16dst, au8src, u16count);
+#elif MODBUS_REGS_STRATEGY == MODBUS_REGS_SWAP
+    ModbusRegs_unpack_swap(au16dst, au8src, u16count);
+#else
+    ModbusRegs_unpack_scalar(au16dst, au8src, u16count);
+#endif
+}
+
+void ModbusBits_pack(uint8_t *au8dst, const uint16_t *au16src, uint16_t u16start, uint16_t u16count)
+{
+    const uint16_t *pword = au16src + (u16start >> 4);
+    uint8_t u8shift = u16start & 0x0F;
+    uint32_t u32bits;
+
+    while (u16count > 0)
+    {
+        u32bits = pword[0] >> u8shift;
+        if (u8shift != 0 && u16count > 16 - u8shift) u32bits |= (uint32_t)pword[1] << (16 - u8shift);
+        if (u16count < 16) u32bits &= (1UL << u16count) - 1;
+
+        *au8dst++ = (uint8_t)(u32bits & 0xFF);
+        if (u16count > 8) *au8dst++ = (uint8_t)((u32bits >> 8) & 0xFF);
+        pword++;
+        u16count = (u16count > 16) ? u16count - 16 : 0;
+    }
+}
+
+void ModbusBits_unpack(uint16_t *au16dst, uint16_t u16start, const uint8_t *au8src, uint16_t u16count)
+{
+    uint16_t *pword = au16dst + (u16start >> 4);
+    uint8_t u8shift = u16start & 0x0F;
+    uint32_t u32bits, u32mask;
+
+    while (u16count > 0)
+    {
+        u32bits = au8src[0];
+        if (u16count > 8) u32bits |= (uint32_t)au8src[1] << 8;
+        u32mask = (u16count < 16) ? (1UL << u16count) - 1 : 0xFFFF;
+        u32bits = (u32bits & u32mask) << u8shift;
+        u32mask <<= u8shift;
+
+        /* an unaligned 16-bit chunk straddles two image words */
+        pword[0] = (uint16_t)((pword[0] & ~u32mask) | u32bits);
+        if ((u32mask >> 16) != 0)
+            pword[1] = (uint16_t)((pword[1] & ~(u32mask >> 16)) | (u32bits >> 16));
+
+        au8src += 2;
+        pword++;
+        u16count = (u16count > 16) ? u16count - 16 : 0;
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef MODBUS_REGS_H
+#define MODBUS_REGS_H
+
+#include <stdint.h>
+
+/* Register and coil block codecs shared by the C++ class and the C ports:
+ * ModbusRegs_* for register blocks (FC3, FC4, FC16, FC23) and
+ * ModbusBits_* for coil blocks (FC1, FC2, FC15).
+ *
+ * Modbus carries registers high byte first; the register kernels move
+ * whole blocks between a host uint16_t array and a frame buffer:
+ *   MODBUS_REGS_SCALAR   byte at a time, any host
+ *   MODBUS_REGS_SWAP     one 16-bit load, swap and store per register
+ *   MODBUS_REGS_SSSE3    16 bytes (8 registers) per pshufb
+ *
+ * Override with -DMODBUS_REGS_STRATEGY=... ; by default x86 builds with
+ * SSSE3 enabled use the shuffle, everything else the word swap. Frame
+ * buffers carry no alignment guarantee.
+ */
+#define MODBUS_REGS_SCALAR  0
+#define MODBUS_REGS_SWAP    1
+#define MODBUS_REGS_SSSE3   2
+
+#ifndef MODBUS_REGS_STRATEGY
+#if defined(__SSSE3__)
+#define MODBUS_REGS_STRATEGY MODBUS_REGS_SSSE3
+#else
+#define MODBUS_REGS_STRATEGY MODBUS_REGS_SWAP
+#endif
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* pack: u16count host registers to 2*u16count wire bytes
+ * unpack: 2*u16count wire bytes to u16count host registers */
+void ModbusRegs_pack_scalar(uint8_t *au8dst, const uint16_t *au16src, uint16_t u16count);
+void ModbusRegs_unpack_scalar(uint16_t *au16dst, const uint8_t *au8src, uint16_t u16count);
+void ModbusRegs_pack_swap(uint8_t *au8dst, const uint16_t *au16src, uint16_t u16count);
+void ModbusRegs_unpack_swap(uint16_t *au16dst, const uint8_t *au8src, uint16_t u16count);
+#if defined(__SSSE3__)
+void ModbusRegs_pack_ssse3(uint8_t *au8dst, const uint16_t *au16src, uint16_t u16count);
+void ModbusRegs_unpack_ssse3(uint16_t *au16dst, const uint8_t *au8src, uint16_t u16count);
+#endif
+
+void ModbusRegs_pack(uint8_t *au8dst, const uint16_t *au16src, uint16_t u16count); //!< compile-time selected strategy
+void ModbusRegs_unpack(uint16_t *au16dst, const uint8_t *au8src, uint16_t u16count); //!< compile-time selected strategy
+
+/* Coil blocks for FC1, FC2 and FC15. Coil n of an image lives in bit n%16 of
+ * word n/16, the wire packs coils LSB first into bytes, so both are the same
+ * little-endian bit string: the kernels move it 16 bits at a time and only
+ * shift when u16start is not a multiple of 16.
+ * pack: u16count coils from bit u16start of the image to (u16count+7)/8
+ *       wire bytes, unused high bits of the last byte cleared
+ * unpack: u16count coils from the wire to bit u16start of the image, the
+ *       other bits of the image are kept */
+void ModbusBits_pack(uint8_t *au8dst, const uint16_t *au16src, uint16_t u16start, uint16_t u16count);
+void ModbusBits_unpack(uint16_t *au16dst, uint16_t u16start, const uint8_t *au8src, uint16_t u16count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MODBUS_REGS_H
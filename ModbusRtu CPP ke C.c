@@ -1,34 +1,214 @@
+// Konstanta baud di atas 38400 dan CRTSCTS hanya terlihat dengan _DEFAULT_SOURCE pada glibc
+#if !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
 #include "ModbusRtu.h"
+#include "ModbusCrc.h"
+#include "ModbusCore.h"
 #include <stdlib.h>
 #include <stdio.h>
-#include <time.h> // Added to provide millis() function
+#include <string.h>
+#include <time.h> // clock_gettime(CLOCK_MONOTONIC) untuk millis() dan micros()
 #include <stdint.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#if defined(__linux__)
+#include <linux/gpio.h>   // GPIO character device untuk jalur arah
+#include <linux/serial.h> // struct serial_rs485 untuk TIOCSRS485
+#endif
 
 // Deklarasi fungsi set_baud_rate
-void set_baud_rate(FILE* port, long u32speed);
+int set_baud_rate(int fd, long u32speed);
 
-// Mock-up function for millis() using clock()
+#if !defined(ARDUINO)
+// Waktu dinding monoton; clock() hanya mengukur waktu CPU proses dan hampir
+// tidak bergerak selama port menunggu data
 unsigned long millis() {
-    unsigned long clocks_per_sec = CLOCKS_PER_SEC;
-    if (clocks_per_sec == 0) {
-        clocks_per_sec = 1000; // Default value if CLOCKS_PER_SEC is not properly defined
-    }
-    return (unsigned long)(clock() / (clocks_per_sec / 1000));
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)((unsigned long long)ts.tv_sec * 1000ULL + (unsigned long long)ts.tv_nsec / 1000000ULL);
 }
 
-Modbus* Modbus_new(uint8_t u8id, FILE* port, uint8_t u8txenpin) {
-    Modbus* modbus = (Modbus*)malloc(sizeof(Modbus));
-    if (modbus == NULL) {
-        return NULL; // Handle memory allocation failure
+unsigned long micros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)((unsigned long long)ts.tv_sec * 1000000ULL + (unsigned long long)ts.tv_nsec / 1000ULL);
+}
+#endif
+
+// Sumber waktu per instance; tanpa clock memakai micros() dan millis()
+void Modbus_setClock(Modbus* modbus, uint32_t (*clock)(struct Modbus*)) {
+    modbus->clock = clock;
+    if (clock == NULL) return;
+    modbus->u32clockUs = clock(modbus);
+    modbus->u32clockMs = 0;
+    modbus->u32clockRem = 0;
+}
+
+uint32_t Modbus_micros(Modbus* modbus) {
+    if (modbus->clock == NULL) return (uint32_t)micros();
+    return modbus->clock(modbus);
+}
+
+uint32_t Modbus_millis(Modbus* modbus) {
+    if (modbus->clock == NULL) return (uint32_t)millis();
+
+    // ms dihitung dari langkah us agar tetap wrap di 2^32 seperti millis()
+    uint32_t u32now = modbus->clock(modbus);
+    modbus->u32clockRem += u32now - modbus->u32clockUs;
+    modbus->u32clockUs = u32now;
+    modbus->u32clockMs += modbus->u32clockRem / 1000;
+    modbus->u32clockRem %= 1000;
+    return modbus->u32clockMs;
+}
+
+// Menunggu tanpa memutar CPU; dipakai sampai stop bit terakhir keluar
+static void Modbus_sleepUs(uint32_t u32us) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)(u32us / 1000000UL);
+    ts.tv_nsec = (long)(u32us % 1000000UL) * 1000L;
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR);
+}
+
+static void Modbus_dirCallbackTx(Modbus* modbus) {
+    modbus->dirCallback(modbus, true);
+}
+
+static void Modbus_dirCallbackRx(Modbus* modbus) {
+    modbus->dirCallback(modbus, false);
+}
+
+#if defined(GPIO_V2_LINE_SET_VALUES_IOCTL)
+static void Modbus_dirGpioSet(Modbus* modbus, bool bTransmit) {
+    struct gpio_v2_line_values values;
+    values.bits = bTransmit ? 1 : 0;
+    values.mask = 1;
+    ioctl(modbus->dirFd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values);
+}
+
+static void Modbus_dirGpioTx(Modbus* modbus) {
+    Modbus_dirGpioSet(modbus, true);
+}
+
+static void Modbus_dirGpioRx(Modbus* modbus) {
+    Modbus_dirGpioSet(modbus, false);
+}
+#endif
+
+const ModbusDir ModbusDir_none = { NULL, NULL };
+const ModbusDir ModbusDir_callback = { Modbus_dirCallbackTx, Modbus_dirCallbackRx };
+#if defined(GPIO_V2_LINE_SET_VALUES_IOCTL)
+const ModbusDir ModbusDir_gpio = { Modbus_dirGpioTx, Modbus_dirGpioRx };
+#else
+const ModbusDir ModbusDir_gpio = { NULL, NULL };
+#endif
+// Kernel menaikkan RTS sebelum kirim dan menurunkannya setelah stop bit terakhir
+const ModbusDir ModbusDir_rs485 = { NULL, NULL };
+
+// Melepas backend arah yang sedang dipakai beserta line GPIO-nya
+void Modbus_setDirNone(Modbus* modbus) {
+    if (modbus->dirFd >= 0) {
+        close(modbus->dirFd);
+        modbus->dirFd = -1;
+    }
+    modbus->dir = &ModbusDir_none;
+}
+
+// Jalur arah diatur oleh aplikasi, mis. digitalWrite(modbus->u8txenpin, bTransmit)
+void Modbus_setDirCallback(Modbus* modbus, void (*callback)(struct Modbus*, bool bTransmit)) {
+    Modbus_setDirNone(modbus);
+    if (callback == NULL) return;
+    modbus->dirCallback = callback;
+    modbus->dir = &ModbusDir_callback;
+}
+
+// Meminta satu line output dari /dev/gpiochipN; awalnya di posisi terima
+int Modbus_setDirGpio(Modbus* modbus, const char *chip, uint32_t u32line, bool bActiveLow) {
+#if defined(GPIO_V2_GET_LINE_IOCTL)
+    struct gpio_v2_line_request req;
+    int chipFd = open(chip, O_RDWR | O_CLOEXEC);
+    if (chipFd < 0) return -1;
+
+    memset(&req, 0, sizeof(req));
+    req.offsets[0] = u32line;
+    req.num_lines = 1;
+    req.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+    if (bActiveLow) req.config.flags |= GPIO_V2_LINE_FLAG_ACTIVE_LOW;
+    req.config.num_attrs = 1;
+    req.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+    req.config.attrs[0].attr.values = 0;
+    req.config.attrs[0].mask = 1;
+    strncpy(req.consumer, "modbus-rtu", sizeof(req.consumer) - 1);
+
+    int rc = ioctl(chipFd, GPIO_V2_GET_LINE_IOCTL, &req);
+    close(chipFd);
+    if (rc < 0) return -1;
+
+    Modbus_setDirNone(modbus);
+    modbus->dirFd = req.fd;
+    modbus->dir = &ModbusDir_gpio;
+    return 0;
+#else
+    (void)modbus; (void)chip; (void)u32line; (void)bActiveLow;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// Menyerahkan RTS ke driver serial; port harus sudah dibuka
+int Modbus_setDirRs485(Modbus* modbus, uint32_t u32delayBefore, uint32_t u32delayAfter) {
+#if defined(TIOCSRS485) && defined(SER_RS485_ENABLED)
+    struct serial_rs485 rs485;
+    if (modbus->fd < 0) {
+        errno = EBADF;
+        return -1;
     }
-    
-    modbus->port = port;
+
+    memset(&rs485, 0, sizeof(rs485));
+    rs485.flags = SER_RS485_ENABLED | SER_RS485_RTS_ON_SEND;
+    rs485.delay_rts_before_send = u32delayBefore;
+    rs485.delay_rts_after_send = u32delayAfter;
+    if (ioctl(modbus->fd, TIOCSRS485, &rs485) < 0) return -1;
+
+    Modbus_setDirNone(modbus);
+    modbus->dir = &ModbusDir_rs485;
+    return 0;
+#else
+    (void)modbus; (void)u32delayBefore; (void)u32delayAfter;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// Inisialisasi instance di storage milik pemanggil (statis, array, atau arena)
+void Modbus_init(Modbus* modbus, uint8_t u8id, int fd, uint8_t u8txenpin) {
+    memset(modbus, 0, sizeof(Modbus));
+    modbus->ops = &Modbus_ops;
+    modbus->fd = fd;
+    modbus->dir = &ModbusDir_none;
+    modbus->dirFd = -1;
     modbus->u8id = u8id;
     modbus->u8txenpin = u8txenpin;
     modbus->u16timeOut = 1000;
     modbus->u32overTime = 0;
+    modbus->clock = NULL;
+    modbus->u32T35 = T35 * 1000UL;
+    modbus->u32char = modbus->u32T35 * 2 / 7;
+}
+
+Modbus* Modbus_new(uint8_t u8id, int fd, uint8_t u8txenpin) {
+    Modbus* modbus = (Modbus*)malloc(sizeof(Modbus));
+    if (modbus == NULL) {
+        return NULL; // Handle memory allocation failure
+    }
     
+    Modbus_init(modbus, u8id, fd, u8txenpin);
     return modbus;
 }
 
@@ -39,17 +219,18 @@ void Modbus_delete(Modbus* modbus) {
 }
 
 // Placeholder definitions for Serial, Serial1, Serial2, Serial3
+// Port belum terbuka; buka dengan Modbus_openSerial sebelum begin
 #if !defined(Serial)
-#define Serial ((FILE *)0) // Replace with appropriate file pointer for Serial port
+#define Serial (-1)
 #endif
 #if !defined(Serial1)
-#define Serial1 ((FILE *)1) // Replace with appropriate file pointer for Serial1
+#define Serial1 (-1)
 #endif
 #if !defined(Serial2)
-#define Serial2 ((FILE *)2) // Replace with appropriate file pointer for Serial2
+#define Serial2 (-1)
 #endif
 #if !defined(Serial3)
-#define Serial3 ((FILE *)3) // Replace with appropriate file pointer for Serial3
+#define Serial3 (-1)
 #endif
 
 Modbus* Modbus_new_with_serial(uint8_t u8id, uint8_t u8serno, uint8_t u8txenpin) {
@@ -58,32 +239,29 @@ Modbus* Modbus_new_with_serial(uint8_t u8id, uint8_t u8serno, uint8_t u8txenpin)
         return NULL; // Handle memory allocation failure
     }
     
-    modbus->u8id = u8id;
-    modbus->u8txenpin = u8txenpin;
-    modbus->u16timeOut = 1000;
-    modbus->u32overTime = 0;
+    Modbus_init(modbus, u8id, Serial, u8txenpin);
 
     switch (u8serno) {
 #if defined(UBRR1H)
         case 1:
-            modbus->port = Serial1;
+            modbus->fd = Serial1;
             break;
 #endif
 
 #if defined(UBRR2H)
         case 2:
-            modbus->port = Serial2;
+            modbus->fd = Serial2;
             break;
 #endif
 
 #if defined(UBRR3H)
         case 3:
-            modbus->port = Serial3;
+            modbus->fd = Serial3;
             break;
 #endif
         case 0:
         default:
-            modbus->port = Serial;
+            modbus->fd = Serial;
             break;
     }
     
@@ -97,42 +275,38 @@ void Modbus_free(Modbus* modbus) {
 }
 
 void Modbus_start(Modbus* modbus) {
-    if (modbus->u8txenpin > 1) { // pin 0 & pin 1 are reserved for RX/TX
-        // Assuming pinMode and digitalWrite are available in your environment
-#if defined(ARDUINO)
-        pinMode(modbus->u8txenpin, 1); // Assuming OUTPUT is defined as 1
-        digitalWrite(modbus->u8txenpin, 0); // Assuming LOW is defined as 0
-#else
-        // Placeholder for platforms that do not support pinMode/digitalWrite
-        // Replace this with appropriate GPIO handling for your environment
-#endif
-    }
+    // Transceiver RS-485 mulai di posisi terima
+    if (modbus->dir->receive != NULL) modbus->dir->receive(modbus);
 
     // Clear the input buffer
-    while (fgetc(modbus->port) != EOF);
+    if (modbus->fd >= 0) tcflush(modbus->fd, TCIFLUSH);
 
-    modbus->u8lastRec = 0;
     modbus->u8BufferSize = 0;
+    modbus->rx.u8state = RX_IDLE;
+    modbus->rx.u16expected = 0;
     modbus->u16InCnt = 0;
     modbus->u16OutCnt = 0;
     modbus->u16errCnt = 0;
 }
 
-void Modbus_begin(Modbus* modbus, FILE* install_port, long u32speed) {
-    modbus->port = install_port;
-    set_baud_rate(install_port, u32speed); // Placeholder to set baud rate
+void Modbus_begin(Modbus* modbus, int install_fd, long u32speed) {
+    modbus->fd = install_fd;
+    set_baud_rate(install_fd, u32speed);
+    Modbus_setBaudRate(modbus, u32speed);
     Modbus_start(modbus);
 }
 
-void Modbus_begin_with_txenpin(Modbus* modbus, FILE* install_port, long u32speed, uint8_t u8txenpin) {
+void Modbus_begin_with_txenpin(Modbus* modbus, int install_fd, long u32speed, uint8_t u8txenpin) {
     modbus->u8txenpin = u8txenpin;
-    modbus->port = install_port;
-    set_baud_rate(install_port, u32speed); // Placeholder to set baud rate
+    modbus->fd = install_fd;
+    set_baud_rate(install_fd, u32speed);
+    Modbus_setBaudRate(modbus, u32speed);
     Modbus_start(modbus);
 }
 
 void Modbus_begin_simple(Modbus* modbus, long u32speed) {
-    set_baud_rate(modbus->port, u32speed); // Cast to appropriate port and set baud rate
+    set_baud_rate(modbus->fd, u32speed);
+    Modbus_setBaudRate(modbus, u32speed);
     Modbus_start(modbus);
 }
 
@@ -154,8 +328,12 @@ void Modbus_setTimeOut(Modbus* modbus, uint16_t u16timeOut) {
     modbus->u16timeOut = u16timeOut;
 }
 
-int Modbus_getTimeOutState(Modbus* modbus) {
-    return ((unsigned long)(millis() - modbus->u32timeOut) > (unsigned long)modbus->u16timeOut);
+uint16_t Modbus_getTimeOut(Modbus* modbus) {
+    return modbus->u16timeOut;
+}
+
+bool Modbus_getTimeOutState(Modbus* modbus) {
+    return ((unsigned long)(Modbus_millis(modbus) - modbus->u32timeOut) > (unsigned long)modbus->u16timeOut);
 }
 
 uint16_t Modbus_getInCnt(Modbus* modbus) {
@@ -178,127 +356,164 @@ uint8_t Modbus_getLastError(Modbus* modbus) {
     return modbus->u8lastError;
 }
 
-// Placeholder for setting baud rate
-void set_baud_rate(FILE* port, long u32speed) {
-    // Implement the baud rate setting for the given port
+// Menghitung T3.5 dan waktu satu karakter dari baud rate
+void Modbus_setBaudRate(Modbus* modbus, long u32speed) {
+    if (u32speed <= 0) return;
+    ModbusCore_timing((uint32_t)u32speed, &modbus->u32T35, &modbus->u32char);
 }
 
-// Functions to handle different types of streams
-void Modbus_start_with_stream(Modbus* modbus, void* stream) {
-    modbus->port = (FILE*)stream;
-    Modbus_start(modbus);
+// Menerjemahkan baud rate ke konstanta termios; 0 jika tidak didukung
+static speed_t Modbus_speed(long u32speed) {
+    switch (u32speed) {
+        case 1200: return B1200;
+        case 2400: return B2400;
+        case 4800: return B4800;
+        case 9600: return B9600;
+        case 19200: return B19200;
+        case 38400: return B38400;
+        case 57600: return B57600;
+        case 115200: return B115200;
+        case 230400: return B230400;
+        default: return 0;
+    }
 }
 
-int8_t Modbus_query(Modbus* modbus, modbus_t telegram) {
-    uint8_t u8regsno, u8bytesno;
-    if (modbus->u8id != 0) return -2;
-    if (modbus->u8state != COM_IDLE) return -1;
+// Mengatur baud rate port lewat termios; -1 jika gagal
+int set_baud_rate(int fd, long u32speed) {
+    struct termios tio;
+    speed_t speed = Modbus_speed(u32speed);
 
-    if ((telegram.u8id == 0) || (telegram.u8id > 247)) return -3;
+    if (fd < 0 || speed == 0) return -1;
+    if (tcgetattr(fd, &tio) != 0) return -1;
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+    return tcsetattr(fd, TCSANOW, &tio);
+}
 
-    modbus->au16regs = telegram.au16reg;
+// Membuka port serial non-blocking dalam mode raw 8 bit dengan paritas yang dipilih
+int Modbus_openSerial(Modbus* modbus, const char *path, long u32speed, uint8_t u8parity) {
+    struct termios tio;
+    int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0) return -1;
 
-    modbus->au8Buffer[ID] = telegram.u8id;
-    modbus->au8Buffer[FUNC] = telegram.u8fct;
-    modbus->au8Buffer[ADD_HI] = (uint8_t)(telegram.u16RegAdd >> 8);
-    modbus->au8Buffer[ADD_LO] = (uint8_t)(telegram.u16RegAdd & 0xFF);
-
-    switch (telegram.u8fct) {
-        case MB_FC_READ_COILS:
-        case MB_FC_READ_DISCRETE_INPUT:
-        case MB_FC_READ_REGISTERS:
-        case MB_FC_READ_INPUT_REGISTER:
-            modbus->au8Buffer[NB_HI] = (uint8_t)(telegram.u16CoilsNo >> 8);
-            modbus->au8Buffer[NB_LO] = (uint8_t)(telegram.u16CoilsNo & 0xFF);
-            modbus->u8BufferSize = 6;
-            break;
-        case MB_FC_WRITE_COIL:
-            modbus->au8Buffer[NB_HI] = ((modbus->au16regs[0] > 0) ? 0xFF : 0);
-            modbus->au8Buffer[NB_LO] = 0;
-            modbus->u8BufferSize = 6;
-            break;
-        case MB_FC_WRITE_REGISTER:
-            modbus->au8Buffer[NB_HI] = (uint8_t)(modbus->au16regs[0] >> 8);
-            modbus->au8Buffer[NB_LO] = (uint8_t)(modbus->au16regs[0] & 0xFF);
-            modbus->u8BufferSize = 6;
+    if (tcgetattr(fd, &tio) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    // Mode raw: tanpa echo, tanpa translasi baris, tanpa flow control
+    tio.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON | IXOFF | IXANY);
+    tio.c_oflag &= ~OPOST;
+    tio.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+    tio.c_cflag &= ~(CSIZE | PARENB | PARODD | CSTOPB | CRTSCTS);
+    tio.c_cflag |= CS8 | CREAD | CLOCAL;
+
+    switch (u8parity) {
+        case PARITY_EVEN:
+            tio.c_cflag |= PARENB;
+            tio.c_iflag |= INPCK;
             break;
-        case MB_FC_WRITE_MULTIPLE_COILS:
-            u8regsno = telegram.u16CoilsNo / 16;
-            u8bytesno = u8regsno * 2;
-            if ((telegram.u16CoilsNo % 16) != 0) {
-                u8bytesno++;
-                u8regsno++;
-            }
-
-            modbus->au8Buffer[NB_HI] = (uint8_t)(telegram.u16CoilsNo >> 8);
-            modbus->au8Buffer[NB_LO] = (uint8_t)(telegram.u16CoilsNo & 0xFF);
-            modbus->au8Buffer[BYTE_CNT] = u8bytesno;
-            modbus->u8BufferSize = 7;
-
-            for (uint16_t i = 0; i < u8bytesno; i++) {
-                if (i % 2) {
-                    modbus->au8Buffer[modbus->u8BufferSize] = (uint8_t)(modbus->au16regs[i / 2] & 0xFF);
-                } else {
-                    modbus->au8Buffer[modbus->u8BufferSize] = (uint8_t)(modbus->au16regs[i / 2] >> 8);
-                }
-                modbus->u8BufferSize++;
-            }
+        case PARITY_ODD:
+            tio.c_cflag |= PARENB | PARODD;
+            tio.c_iflag |= INPCK;
             break;
-        case MB_FC_WRITE_MULTIPLE_REGISTERS:
-            modbus->au8Buffer[NB_HI] = (uint8_t)(telegram.u16CoilsNo >> 8);
-            modbus->au8Buffer[NB_LO] = (uint8_t)(telegram.u16CoilsNo & 0xFF);
-            modbus->au8Buffer[BYTE_CNT] = (uint8_t)(telegram.u16CoilsNo * 2);
-            modbus->u8BufferSize = 7;
-
-            for (uint16_t i = 0; i < telegram.u16CoilsNo; i++) {
-                modbus->au8Buffer[modbus->u8BufferSize] = (uint8_t)(modbus->au16regs[i] >> 8);
-                modbus->u8BufferSize++;
-                modbus->au8Buffer[modbus->u8BufferSize] = (uint8_t)(modbus->au16regs[i] & 0xFF);
-                modbus->u8BufferSize++;
-            }
+        case PARITY_NONE:
+        default:
+            tio.c_cflag |= CSTOPB;
             break;
     }
 
-    void Modbus_sendTxBuffer(Modbus* modbus); // Forward declaration
+    // read() langsung kembali; batas frame ditentukan oleh T35, bukan oleh driver
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
 
-    Modbus_sendTxBuffer(modbus);
-    modbus->u8state = COM_WAITING;
-    modbus->u8lastError = 0;
-    return 0;
+    if (tcsetattr(fd, TCSANOW, &tio) != 0 || set_baud_rate(fd, u32speed) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    modbus->fd = fd;
+    Modbus_setBaudRate(modbus, u32speed);
+    Modbus_start(modbus);
+    return fd;
+}
+
+void Modbus_closeSerial(Modbus* modbus) {
+    if (modbus->fd >= 0) {
+        close(modbus->fd);
+        modbus->fd = -1;
+    }
+}
+
+// Jumlah byte yang menunggu di buffer driver, tanpa mengonsumsinya
+uint8_t Modbus_available(Modbus* modbus) {
+    int n = 0;
+    if (modbus->fd < 0 || ioctl(modbus->fd, FIONREAD, &n) != 0 || n <= 0) return 0;
+    return (n > 0xFF) ? 0xFF : (uint8_t)n;
+}
+
+// Functions to handle different types of streams
+void Modbus_start_with_stream(Modbus* modbus, int fd) {
+    modbus->fd = fd;
+    Modbus_start(modbus);
 }
 
-// Modbus_poll
 // Forward declarations for undefined functions
-uint8_t Modbus_available(Modbus* modbus);
 int8_t Modbus_getRxBuffer(Modbus* modbus);
+void Modbus_sendTxBuffer(Modbus* modbus);
+uint16_t Modbus_calcCRC(Modbus* modbus, uint8_t u8length);
 uint8_t Modbus_validateAnswer(Modbus* modbus);
+uint8_t Modbus_validateRequest(Modbus* modbus);
+void Modbus_buildException(Modbus* modbus, uint8_t u8exception);
 void Modbus_get_FC1(Modbus* modbus);
 void Modbus_get_FC3(Modbus* modbus);
+int8_t Modbus_process_FC1(Modbus* modbus, uint16_t* regs, uint8_t u8size);
+int8_t Modbus_process_FC3(Modbus* modbus, uint16_t* regs, uint8_t u8size);
+int8_t Modbus_process_FC5(Modbus* modbus, uint16_t* regs, uint8_t u8size);
+int8_t Modbus_process_FC6(Modbus* modbus, uint16_t* regs, uint8_t u8size);
+int8_t Modbus_process_FC15(Modbus* modbus, uint16_t* regs, uint8_t u8size);
+int8_t Modbus_process_FC16(Modbus* modbus, uint16_t* regs, uint8_t u8size);
+static int8_t Modbus_process(Modbus* modbus, uint16_t* regs, uint8_t u8size);
 
-int8_t Modbus_poll(Modbus* modbus) {
-    uint8_t u8current;
-    u8current = Modbus_available(modbus);
+int8_t Modbus_query(Modbus* modbus, modbus_t telegram) {
+    if (modbus->u8id != 0) return -2;
+    if (modbus->u8state != COM_IDLE) return -1;
 
-    if ((unsigned long)(millis() - modbus->u32timeOut) > (unsigned long)modbus->u16timeOut) {
-        modbus->u8state = COM_IDLE;
-        modbus->u8lastError = NO_REPLY;
-        modbus->u16errCnt++;
-        return 0;
-    }
+    if ((telegram.u8id == 0) || (telegram.u8id > 247)) return -3;
+
+    // Frame permintaan dan panjang jawaban yang diharapkan disusun oleh inti protokol
+    int16_t i16length = ModbusCore_query(modbus->au8Buffer, MAX_BUFFER, &telegram, &modbus->rx.u16expected);
+    if (i16length < 0) return (int8_t)i16length;
+
+    modbus->au16regs = telegram.au16reg;
+    modbus->u16queryNo = telegram.u16CoilsNo;
+    modbus->u8BufferSize = (uint8_t)i16length;
 
-    if (u8current == 0) return 0;
+    Modbus_sendTxBuffer(modbus);
+    modbus->u8state = COM_WAITING;
+    modbus->u8lastError = 0;
+    return 0;
+}
 
-    if (u8current != modbus->u8lastRec) {
-        modbus->u8lastRec = u8current;
-        modbus->u32time = millis();
+int8_t Modbus_poll(Modbus* modbus) {
+    // Frame dirakit tiap panggilan; jawaban yang panjangnya diprediksi selesai tanpa menunggu T3.5
+    int8_t i8state = Modbus_getRxBuffer(modbus);
+    if (i8state == 0) {
+        // Time out hanya untuk giliran slave; jawaban yang sudah mulai berakhir sendiri
+        if (modbus->u8state == COM_WAITING && modbus->rx.u8state == RX_IDLE &&
+            (unsigned long)(Modbus_millis(modbus) - modbus->u32timeOut) > (unsigned long)modbus->u16timeOut) {
+            modbus->u8state = COM_IDLE;
+            modbus->u8lastError = NO_REPLY;
+            modbus->rx.u16expected = 0;
+            modbus->u16errCnt++;
+        }
         return 0;
     }
-    if ((unsigned long)(millis() - modbus->u32time) < (unsigned long)T35) return 0;
 
-    modbus->u8lastRec = 0;
-    int8_t i8state = Modbus_getRxBuffer(modbus);
-    if (i8state < 6) {
+    modbus->rx.u16expected = 0;
+    if (i8state < EXCEPTION_SIZE + CHECKSUM_SIZE) { // jawaban exception adalah frame terpendek
         modbus->u8state = COM_IDLE;
+        modbus->u8lastError = (i8state < 0) ? (uint8_t)i8state : (uint8_t)ERR_BAD_SIZE;
         modbus->u16errCnt++;
         return i8state;
     }
@@ -306,28 +521,18 @@ int8_t Modbus_poll(Modbus* modbus) {
     uint8_t u8exception = Modbus_validateAnswer(modbus);
     if (u8exception != 0) {
         modbus->u8state = COM_IDLE;
-        return u8exception;
+        modbus->u8lastError = u8exception;
+        return (int8_t)u8exception;
     }
 
-    switch (modbus->au8Buffer[FUNC]) {
-        case MB_FC_READ_COILS:
-        case MB_FC_READ_DISCRETE_INPUT:
-            Modbus_get_FC1(modbus);
-            break;
-        case MB_FC_READ_INPUT_REGISTER:
-        case MB_FC_READ_REGISTERS:
-            Modbus_get_FC3(modbus);
-            break;
-        case MB_FC_WRITE_COIL:
-        case MB_FC_WRITE_REGISTER:
-        case MB_FC_WRITE_MULTIPLE_COILS:
-        case MB_FC_WRITE_MULTIPLE_REGISTERS:
-            // nothing to do
-            break;
-        default:
-            break;
-    }
+    // Data jawaban baca disalin ke au16regs; byte count harus sesuai jumlah yang diminta
     modbus->u8state = COM_IDLE;
+    int8_t i8answer = ModbusCore_getAnswer(modbus->au8Buffer, modbus->au16regs, modbus->u16queryNo);
+    if (i8answer != 0) {
+        modbus->u8lastError = (uint8_t)i8answer;
+        modbus->u16errCnt++;
+        return i8answer;
+    }
     return modbus->u8BufferSize;
 }
 
@@ -335,39 +540,12 @@ int8_t Modbus_poll(Modbus* modbus) {
 int8_t Modbus_pollWithRegs(Modbus* modbus, uint16_t *regs, uint8_t u8size) {
     modbus->au16regs = regs;
     modbus->u8regsize = u8size;
-    uint8_t u8current;
-
-    // Mengecek apakah data tersedia di serial port
-    // NOTE: Fungsi fgetc hanya digunakan sebagai contoh, perlu diganti dengan API yang tepat untuk serial
-    if (modbus->port != NULL) {
-        u8current = fgetc(modbus->port);
-    } else {
-        u8current = 0;
-    }
-    
-    if (u8current == EOF) {
-        // Jika tidak ada data yang diterima
-        return 0;
-    }
-
-    // Mengecek jika ada perubahan pada buffer terakhir
-    if (u8current != modbus->u8lastRec) {
-        modbus->u8lastRec = u8current;
-        modbus->u32time = millis();
-        return 0;
-    }
-
-    if ((unsigned long)(millis() - modbus->u32time) < (unsigned long)T35) {
-        return 0;
-    }
-
-    // Reset last received
-    modbus->u8lastRec = 0;
 
-    // Mengambil data dari buffer
-    int8_t i8state = modbus->getRxBuffer(modbus);
+    // Permintaan berakhir setelah T3.5 hening di belakang byte terakhir
+    int8_t i8state = Modbus_getRxBuffer(modbus);
+    if (i8state == 0) return 0;
     modbus->u8lastError = i8state;
-    if (i8state < 7) {
+    if (i8state < 2 + CHECKSUM_SIZE) { // minimal ID dan FUNC
         return i8state;
     }
 
@@ -377,132 +555,104 @@ int8_t Modbus_pollWithRegs(Modbus* modbus, uint16_t *regs, uint8_t u8size) {
     }
 
     // Memvalidasi pesan: CRC, FCT, alamat dan ukuran
-    uint8_t u8exception = modbus->validateRequest(modbus);
+    uint8_t u8exception = Modbus_validateRequest(modbus);
     if (u8exception > 0) {
         if (u8exception != NO_REPLY) {
-            modbus->buildException(modbus, u8exception);
-            modbus->sendTxBuffer(modbus);
+            Modbus_buildException(modbus, u8exception);
+            Modbus_sendTxBuffer(modbus);
         }
         modbus->u8lastError = u8exception;
         return u8exception;
     }
 
-    modbus->u32timeOut = millis();
+    modbus->u32timeOut = Modbus_millis(modbus);
     modbus->u8lastError = 0;
 
-    // Memproses pesan berdasarkan fungsi kode (function code)
-    switch (modbus->au8Buffer[FUNC]) {
-        case MB_FC_READ_COILS:
-        case MB_FC_READ_DISCRETE_INPUT:
-            return modbus->process_FC1(modbus, regs, u8size);
-            break;
-        case MB_FC_READ_INPUT_REGISTER:
-        case MB_FC_READ_REGISTERS:
-            return modbus->process_FC3(modbus, regs, u8size);
-            break;
-        case MB_FC_WRITE_COIL:
-            return modbus->process_FC5(modbus, regs, u8size);
-            break;
-        case MB_FC_WRITE_REGISTER:
-            return modbus->process_FC6(modbus, regs, u8size);
-            break;
-        case MB_FC_WRITE_MULTIPLE_COILS:
-            return modbus->process_FC15(modbus, regs, u8size);
-            break;
-        case MB_FC_WRITE_MULTIPLE_REGISTERS:
-            return modbus->process_FC16(modbus, regs, u8size);
-            break;
-        default:
-            break;
-    }
-
-    return i8state;
+    // Memproses pesan; jawaban disusun di au8Buffer oleh inti protokol
+    return Modbus_process(modbus, regs, u8size);
 }
 
 // Implementasi getRxBuffer untuk Modbus dalam C
+// Menambahkan byte yang sudah tiba ke frame yang sedang diterima. Mengembalikan
+// panjang frame begitu jawaban yang diprediksi lengkap atau setelah T3.5 hening,
+// 0 selama frame belum selesai, dan ERR_BUFF_OVERFLOW untuk frame yang terlalu panjang
 int8_t Modbus_getRxBuffer(Modbus* modbus) {
-    bool bBuffOverflow = false;
-
-    // Mengatur pin TX enable ke LOW jika diperlukan (pengganti digitalWrite)
-    if (modbus->u8txenpin > 1) {
-        // Placeholder untuk menggantikan fungsi digitalWrite pada platform yang relevan
-        // Misalnya, gunakan GPIO handling yang sesuai untuk platform Anda
-        printf("Setting TX enable pin %d to LOW\n", modbus->u8txenpin);
-    }
-
-    modbus->u8BufferSize = 0;
-
-    // Membaca data dari port
-    while (1) {
-        int c = fgetc(modbus->port);
-        if (c == EOF) {
-            break;  // Jika tidak ada data lagi
-        }
-
-        // Menyimpan data ke buffer
-        modbus->au8Buffer[modbus->u8BufferSize] = (uint8_t)c;
-        modbus->u8BufferSize++;
-
-        // Mengecek apakah buffer overflow terjadi
-        if (modbus->u8BufferSize >= MAX_BUFFER) {
-            bBuffOverflow = true;
-            break;  // Keluar dari loop jika buffer penuh
+    uint32_t u32now = Modbus_micros(modbus);
+    uint8_t au8chunk[MAX_BUFFER];
+
+    while (modbus->fd >= 0) {
+        ssize_t n = read(modbus->fd, au8chunk, sizeof(au8chunk));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;  // EAGAIN: tidak ada data lagi
+
+        if (modbus->rx.u8state == RX_IDLE) ModbusCore_rxBegin(&modbus->rx);
+        modbus->u32time = u32now;
+        if (ModbusCore_rxPut(&modbus->rx, modbus->au8Buffer, MAX_BUFFER, au8chunk, (uint16_t)n)) {
+            modbus->u8BufferSize = (uint8_t)modbus->rx.u16length;
+            modbus->u16InCnt++;
+            return (int8_t)modbus->u8BufferSize;
         }
     }
 
-    // Menambah jumlah hitungan data masuk
-    modbus->u16InCnt++;
+    // Frame berakhir setelah T3.5 hening; byte frame yang meluap dibuang sampai saat itu
+    if (modbus->rx.u8state == RX_IDLE) return 0;
+    if ((unsigned long)(u32now - modbus->u32time) < (unsigned long)modbus->u32T35) return 0;
 
-    // Jika terjadi buffer overflow
-    if (bBuffOverflow) {
+    int16_t i16length = ModbusCore_rxEnd(&modbus->rx);
+    modbus->u8BufferSize = (uint8_t)modbus->rx.u16length;
+    modbus->u16InCnt++;
+    if (i16length < 0) {
         modbus->u16errCnt++;
         return ERR_BUFF_OVERFLOW;
     }
-
-    return modbus->u8BufferSize;
+    return (int8_t)i16length;
 }
 
 // Implementasi sendTxBuffer untuk Modbus dalam C
 void Modbus_sendTxBuffer(Modbus* modbus) {
-    // Menghitung CRC dan menambahkan ke buffer
-    uint16_t u16crc = modbus->calcCRC(modbus, modbus->u8BufferSize);
-    modbus->au8Buffer[modbus->u8BufferSize] = u16crc >> 8;  // CRC high byte
-    modbus->u8BufferSize++;
-    modbus->au8Buffer[modbus->u8BufferSize] = u16crc & 0x00ff;  // CRC low byte
-    modbus->u8BufferSize++;
-
-    // Mengatur TX enable pin ke HIGH jika diperlukan (menggantikan digitalWrite)
-    if (modbus->u8txenpin > 1) {
-        // Placeholder untuk mengatur GPIO sesuai platform yang digunakan
-        printf("Setting TX enable pin %d to HIGH\n", modbus->u8txenpin);
-    }
-
-    // Menulis buffer ke port serial
-    if (modbus->port != NULL) {
-        for (uint8_t i = 0; i < modbus->u8BufferSize; i++) {
-            fputc(modbus->au8Buffer[i], modbus->port);  // Menulis byte ke serial
+    // Menambahkan CRC ke buffer, low byte terlebih dahulu
+    modbus->u8BufferSize = (uint8_t)ModbusCore_seal(modbus->au8Buffer, modbus->u8BufferSize);
+
+    // Transceiver RS-485 ke posisi kirim
+    if (modbus->dir->transmit != NULL) modbus->dir->transmit(modbus);
+    uint32_t u32txStart = Modbus_micros(modbus);
+
+    // Menulis seluruh frame ke port serial dengan satu write()
+    uint8_t u8sent = 0;
+    while (modbus->fd >= 0 && u8sent < modbus->u8BufferSize) {
+        ssize_t n = write(modbus->fd, modbus->au8Buffer + u8sent, modbus->u8BufferSize - u8sent);
+        if (n > 0) {
+            u8sent += (uint8_t)n;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // Buffer driver penuh: tunggu sampai port siap ditulis lagi
+            struct pollfd pfd = { modbus->fd, POLLOUT, 0 };
+            poll(&pfd, 1, -1);
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            break;
         }
     }
 
-    // Mengatur TX enable pin ke LOW setelah transmisi selesai
-    if (modbus->u8txenpin > 1) {
-        // Simulasikan `flush()` dengan penundaan untuk memastikan buffer dikirim sepenuhnya
-        fflush(modbus->port);  // Flush output buffer untuk memastikan semua data dikirim
-        volatile uint32_t u32overTimeCountDown = modbus->u32overTime;
-        while (u32overTimeCountDown-- > 0);  // Menunggu waktu "over time" selesai
-        printf("Setting TX enable pin %d to LOW\n", modbus->u8txenpin);
+    // Jalur dilepas setelah stop bit terakhir: tcdrain menunggu antrean driver,
+    // sisa FIFO UART ditunggu sampai waktu frame yang dihitung dari baud rate
+    if (modbus->dir->receive != NULL) {
+        if (modbus->fd >= 0) tcdrain(modbus->fd);
+        uint32_t u32txTime = (uint32_t)modbus->u8BufferSize * modbus->u32char + modbus->u32overTime;
+        uint32_t u32elapsed = Modbus_micros(modbus) - u32txStart;
+        if (u32elapsed < u32txTime) Modbus_sleepUs(u32txTime - u32elapsed);
+        modbus->dir->receive(modbus);
     }
 
     // Membersihkan input serial (mengganti `port->read()` di C++)
-    while (modbus->port != NULL && fgetc(modbus->port) != EOF) {
-        // Bersihkan data yang tersisa
-    }
+    if (modbus->fd >= 0) tcflush(modbus->fd, TCIFLUSH);
 
-    // Mengatur ukuran buffer kembali ke 0
+    // Mengatur ukuran buffer kembali ke 0; frame masuk yang belum selesai ditinggalkan
     modbus->u8BufferSize = 0;
+    modbus->rx.u8state = RX_IDLE;
 
     // Memperbarui time out
-    modbus->u32timeOut = millis();
+    modbus->u32timeOut = Modbus_millis(modbus);
 
     // Menambah hitungan data keluar
     modbus->u16OutCnt++;
@@ -510,399 +660,124 @@ void Modbus_sendTxBuffer(Modbus* modbus) {
 
 // Implementasi calcCRC untuk Modbus dalam C
 uint16_t Modbus_calcCRC(Modbus* modbus, uint8_t u8length) {
-    unsigned int temp, temp2, flag;
-    temp = 0xFFFF;
-
-    // Perulangan untuk setiap byte dalam buffer
-    for (unsigned char i = 0; i < u8length; i++) {
-        temp = temp ^ modbus->au8Buffer[i];  // XOR byte saat ini dengan nilai CRC
-
-        // Perulangan untuk setiap bit dalam byte
-        for (unsigned char j = 1; j <= 8; j++) {
-            flag = temp & 0x0001;  // Memeriksa bit LSB
-            temp >>= 1;            // Geser ke kanan satu bit
-            if (flag) {
-                temp ^= 0xA001;    // XOR dengan polinomial jika bit LSB adalah 1
-            }
-        }
-    }
+    // Strategi CRC (bitwise/nibble/tabel/slice-by-8) dipilih saat kompilasi di ModbusCrc.h
+    uint16_t u16crc = ModbusCRC_update(MODBUS_CRC_INIT, modbus->au8Buffer, u8length);
 
     // Tukar byte CRC agar sesuai dengan format Modbus (Little Endian)
-    temp2 = temp >> 8;            // Ambil high byte dari CRC
-    temp = (temp << 8) | temp2;   // Gabungkan dengan low byte
-    temp &= 0xFFFF;               // Masking untuk memastikan CRC 16-bit
-
-    return temp;  // Mengembalikan nilai CRC
+    return (uint16_t)((u16crc << 8) | (u16crc >> 8));
 }
 
 // Implementasi validateRequest untuk Modbus dalam C
 uint8_t Modbus_validateRequest(Modbus* modbus) {
-    // Menggabungkan CRC dari dua byte terakhir dalam buffer
-    uint16_t u16MsgCRC = ((modbus->au8Buffer[modbus->u8BufferSize - 2] << 8) |
-                          modbus->au8Buffer[modbus->u8BufferSize - 1]);
-
-    // Memeriksa apakah CRC yang dihitung cocok dengan CRC di dalam pesan
-    if (modbus->calcCRC(modbus, modbus->u8BufferSize - 2) != u16MsgCRC) {
+    // CRC sudah dihitung sambil menerima; frame yang utuh tidak menyisakan residu
+    if (modbus->rx.u16crc != MODBUS_CRC_RESIDUE) {
         modbus->u16errCnt++;
         return NO_REPLY;
     }
 
-    // Memeriksa kode fungsi apakah didukung
-    bool isSupported = false;
-    for (uint8_t i = 0; i < sizeof(fctsupported); i++) {
-        if (fctsupported[i] == modbus->au8Buffer[FUNC]) {
-            isSupported = true;
-            break;
-        }
-    }
-
-    // Jika fungsi tidak didukung, kembalikan kode exception
-    if (!isSupported) {
+    // Kode fungsi, jumlah, dan alamat diperiksa oleh inti protokol terhadap au16regs
+    modbus_flat_t flat = { modbus->au16regs, modbus->u8regsize };
+    uint8_t u8exception = ModbusCore_checkRequest(&ModbusCore_flat, &flat, modbus->au8Buffer,
+                                                  modbus->u8BufferSize, MAX_BUFFER);
+    if (u8exception == EXC_FUNC_CODE || u8exception == NO_REPLY) {
         modbus->u16errCnt++;
-        return EXC_FUNC_CODE;
     }
-
-    // Memeriksa alamat dan jumlah register
-    uint16_t u16regs = 0;
-    uint8_t u8regs;
-
-    switch (modbus->au8Buffer[FUNC]) {
-        case MB_FC_READ_COILS:
-        case MB_FC_READ_DISCRETE_INPUT:
-        case MB_FC_WRITE_MULTIPLE_COILS:
-            u16regs = ((modbus->au8Buffer[ADD_HI] << 8) | modbus->au8Buffer[ADD_LO]) / 16;
-            u16regs += ((modbus->au8Buffer[NB_HI] << 8) | modbus->au8Buffer[NB_LO]) / 16;
-            u8regs = (uint8_t)u16regs;
-            if (u8regs > modbus->u8regsize) {
-                return EXC_ADDR_RANGE;
-            }
-            break;
-
-        case MB_FC_WRITE_COIL:
-            u16regs = ((modbus->au8Buffer[ADD_HI] << 8) | modbus->au8Buffer[ADD_LO]) / 16;
-            u8regs = (uint8_t)u16regs;
-            if (u8regs > modbus->u8regsize) {
-                return EXC_ADDR_RANGE;
-            }
-            break;
-
-        case MB_FC_WRITE_REGISTER:
-            u16regs = (modbus->au8Buffer[ADD_HI] << 8) | modbus->au8Buffer[ADD_LO];
-            u8regs = (uint8_t)u16regs;
-            if (u8regs > modbus->u8regsize) {
-                return EXC_ADDR_RANGE;
-            }
-            break;
-
-        case MB_FC_READ_REGISTERS:
-        case MB_FC_READ_INPUT_REGISTER:
-        case MB_FC_WRITE_MULTIPLE_REGISTERS:
-            u16regs = (modbus->au8Buffer[ADD_HI] << 8) | modbus->au8Buffer[ADD_LO];
-            u16regs += (modbus->au8Buffer[NB_HI] << 8) | modbus->au8Buffer[NB_LO];
-            u8regs = (uint8_t)u16regs;
-            if (u8regs > modbus->u8regsize) {
-                return EXC_ADDR_RANGE;
-            }
-            break;
-
-        default:
-            // Jika kode fungsi tidak sesuai dengan yang diharapkan
-            break;
-    }
-
-    // Jika semua pemeriksaan lulus, kembalikan nilai 0 (tidak ada exception)
-    return 0;
+    return u8exception;
 }
 
 // Implementasi validateAnswer untuk Modbus dalam C
 uint8_t Modbus_validateAnswer(Modbus* modbus) {
-    // Menggabungkan CRC dari dua byte terakhir dalam buffer
-    uint16_t u16MsgCRC = ((modbus->au8Buffer[modbus->u8BufferSize - 2] << 8) |
-                          modbus->au8Buffer[modbus->u8BufferSize - 1]);
-
-    // Memeriksa apakah CRC yang dihitung cocok dengan CRC di dalam pesan
-    if (modbus->calcCRC(modbus, modbus->u8BufferSize - 2) != u16MsgCRC) {
-        modbus->u16errCnt++;
-        return NO_REPLY;
-    }
-
-    // Memeriksa bit error di dalam kode fungsi (fungsi error ditandai dengan bit MSB yang di-set)
-    if ((modbus->au8Buffer[FUNC] & 0x80) != 0) {
-        modbus->u16errCnt++;
-        return ERR_EXCEPTION;
-    }
-
-    // Memeriksa apakah kode fungsi didukung
-    bool isSupported = false;
-    for (uint8_t i = 0; i < sizeof(fctsupported); i++) {
-        if (fctsupported[i] == modbus->au8Buffer[FUNC]) {
-            isSupported = true;
-            break;
-        }
-    }
-
-    // Jika fungsi tidak didukung, kembalikan kode exception
-    if (!isSupported) {
+    uint8_t u8exception = ModbusCore_checkAnswer(&modbus->rx, modbus->au8Buffer);
+    if (u8exception != 0) {
         modbus->u16errCnt++;
-        return EXC_FUNC_CODE;
     }
-
-    // Jika semua pemeriksaan lulus, kembalikan nilai 0 (tidak ada exception)
-    return 0;
+    return u8exception;
 }
 
 // Implementasi buildException untuk Modbus dalam C
 void Modbus_buildException(Modbus* modbus, uint8_t u8exception) {
-    // Mengambil kode fungsi asli dari buffer
-    uint8_t u8func = modbus->au8Buffer[FUNC];
-
-    // Membangun pesan exception
-    modbus->au8Buffer[ID] = modbus->u8id;
-    modbus->au8Buffer[FUNC] = u8func + 0x80;  // Menandai bahwa ini adalah exception dengan menambah 0x80
-    modbus->au8Buffer[2] = u8exception;       // Kode exception
-    modbus->u8BufferSize = EXCEPTION_SIZE;    // Ukuran buffer exception yang ditetapkan
+    modbus->u8BufferSize = (uint8_t)ModbusCore_exception(modbus->au8Buffer, modbus->u8id, u8exception);
 }
 
-// Implementasi get_FC1 untuk Modbus dalam C
+// get_FC1 dan get_FC3 menyalin jawaban baca ke au16regs
 void Modbus_get_FC1(Modbus* modbus) {
-    uint8_t u8byte = 3;  // Offset untuk data dalam buffer
-    uint8_t i;
-
-    // Perulangan untuk memproses setiap byte data
-    for (i = 0; i < modbus->au8Buffer[2]; i++) {
-        if (i % 2) {
-            // Jika `i` adalah ganjil, menggabungkan byte saat ini dengan low byte dari register
-            modbus->au16regs[i / 2] = ((modbus->au8Buffer[i + u8byte] << 8) |
-                                       (modbus->au16regs[i / 2] & 0x00FF));
-        } else {
-            // Jika `i` adalah genap, menggabungkan high byte dari register dengan byte saat ini
-            modbus->au16regs[i / 2] = ((modbus->au16regs[i / 2] & 0xFF00) |
-                                       modbus->au8Buffer[i + u8byte]);
-        }
-    }
+    ModbusCore_getAnswer(modbus->au8Buffer, modbus->au16regs, modbus->u16queryNo);
 }
 
-// Implementasi get_FC3 untuk Modbus dalam C
 void Modbus_get_FC3(Modbus* modbus) {
-    uint8_t u8byte = 3;  // Offset untuk data dalam buffer
-    uint8_t i;
-
-    // Perulangan untuk memproses setiap register yang diterima
-    for (i = 0; i < (modbus->au8Buffer[2] / 2); i++) {
-        // Menggabungkan dua byte menjadi satu register 16-bit
-        modbus->au16regs[i] = ((modbus->au8Buffer[u8byte] << 8) | modbus->au8Buffer[u8byte + 1]);
-        u8byte += 2;  // Increment by 2 untuk mengakses register berikutnya
-    }
+    ModbusCore_getAnswer(modbus->au8Buffer, modbus->au16regs, modbus->u16queryNo);
 }
 
-// Implementasi process_FC1 untuk Modbus dalam C
-int8_t Modbus_process_FC1(Modbus* modbus, uint16_t* regs, uint8_t u8size) {
-    uint8_t u8currentRegister, u8currentBit, u8bytesno, u8bitsno;
-    uint8_t u8CopyBufferSize;
-    uint16_t u16currentCoil, u16coil;
-
-    // Menghitung nilai awal coil dan jumlah coil berdasarkan buffer
-    uint16_t u16StartCoil = (modbus->au8Buffer[ADD_HI] << 8) | modbus->au8Buffer[ADD_LO];
-    uint16_t u16Coilno = (modbus->au8Buffer[NB_HI] << 8) | modbus->au8Buffer[NB_LO];
-
-    // Menghitung jumlah byte yang diperlukan untuk menyimpan status coil
-    u8bytesno = (uint8_t)(u16Coilno / 8);
-    if (u16Coilno % 8 != 0) {
-        u8bytesno++;
-    }
-    modbus->au8Buffer[ADD_HI] = u8bytesno;
-    modbus->u8BufferSize = ADD_LO;
-
-    // Inisialisasi nilai akhir buffer terakhir menjadi 0
-    modbus->au8Buffer[modbus->u8BufferSize + u8bytesno - 1] = 0;
-
-    // Inisialisasi bit index yang sedang diakses
-    u8bitsno = 0;
-
-    // Perulangan untuk setiap coil yang harus dibaca
-    for (u16currentCoil = 0; u16currentCoil < u16Coilno; u16currentCoil++) {
-        u16coil = u16StartCoil + u16currentCoil;
-        u8currentRegister = (uint8_t)(u16coil / 16);
-        u8currentBit = (uint8_t)(u16coil % 16);
-
-        // Mengatur bit di buffer untuk status coil yang dibaca
-        if ((regs[u8currentRegister] & (1 << u8currentBit)) != 0) {
-            modbus->au8Buffer[modbus->u8BufferSize] |= (1 << u8bitsno);
-        } else {
-            modbus->au8Buffer[modbus->u8BufferSize] &= ~(1 << u8bitsno);
-        }
-        u8bitsno++;
-
-        // Jika sudah mencapai 8 bit, pindah ke byte berikutnya
-        if (u8bitsno > 7) {
-            u8bitsno = 0;
-            modbus->u8BufferSize++;
-        }
-    }
-
-    // Jika jumlah coil tidak habis dibagi 8, tambahkan satu byte ke ukuran buffer
-    if (u16Coilno % 8 != 0) {
-        modbus->u8BufferSize++;
-    }
-    u8CopyBufferSize = modbus->u8BufferSize + 2;
-
-    // Mengirim buffer ke port serial
-    modbus->sendTxBuffer(modbus);
+// Menyusun jawaban untuk permintaan yang sudah divalidasi lalu mengirimnya
+static int8_t Modbus_process(Modbus* modbus, uint16_t* regs, uint8_t u8size) {
+    modbus_flat_t flat = { regs, u8size };
+    modbus->u8BufferSize = (uint8_t)ModbusCore_process(&ModbusCore_flat, &flat, modbus->au8Buffer);
+    int8_t i8answer = (int8_t)(modbus->u8BufferSize + CHECKSUM_SIZE);
+    Modbus_sendTxBuffer(modbus);
+    return i8answer;
+}
 
-    return u8CopyBufferSize;
+int8_t Modbus_process_FC1(Modbus* modbus, uint16_t* regs, uint8_t u8size) {
+    return Modbus_process(modbus, regs, u8size);
 }
 
-// Implementasi process_FC3 untuk Modbus dalam C
 int8_t Modbus_process_FC3(Modbus* modbus, uint16_t* regs, uint8_t u8size) {
-    uint16_t u16StartAdd = (modbus->au8Buffer[ADD_HI] << 8) | modbus->au8Buffer[ADD_LO];
-    uint16_t u16regsno = (modbus->au8Buffer[NB_HI] << 8) | modbus->au8Buffer[NB_LO];
-    uint8_t u8CopyBufferSize;
-    uint16_t i;
-
-    // Mengatur jumlah byte data yang akan dikirim
-    modbus->au8Buffer[2] = u16regsno * 2;
-    modbus->u8BufferSize = 3;
-
-    // Mengisi buffer dengan nilai register
-    for (i = u16StartAdd; i < u16StartAdd + u16regsno; i++) {
-        modbus->au8Buffer[modbus->u8BufferSize] = (uint8_t)(regs[i] >> 8);  // High byte dari register
-        modbus->u8BufferSize++;
-        modbus->au8Buffer[modbus->u8BufferSize] = (uint8_t)(regs[i] & 0xFF); // Low byte dari register
-        modbus->u8BufferSize++;
-    }
-
-    u8CopyBufferSize = modbus->u8BufferSize + 2;
-
-    // Mengirim buffer ke port serial
-    modbus->sendTxBuffer(modbus);
-
-    return u8CopyBufferSize;
+    return Modbus_process(modbus, regs, u8size);
 }
 
-// Implementasi process_FC5 untuk Modbus dalam C
 int8_t Modbus_process_FC5(Modbus* modbus, uint16_t* regs, uint8_t u8size) {
-    uint8_t u8currentRegister, u8currentBit;
-    uint8_t u8CopyBufferSize;
-
-    // Menggabungkan dua byte untuk mendapatkan alamat coil
-    uint16_t u16coil = (modbus->au8Buffer[ADD_HI] << 8) | modbus->au8Buffer[ADD_LO];
-    u8currentRegister = (uint8_t)(u16coil / 16);  // Menghitung register saat ini berdasarkan alamat coil
-    u8currentBit = (uint8_t)(u16coil % 16);       // Menghitung posisi bit dalam register
-
-    // Mengatur nilai bit di register sesuai dengan nilai yang diterima
-    if (modbus->au8Buffer[NB_HI] == 0xFF) {
-        regs[u8currentRegister] |= (1 << u8currentBit);  // Menulis '1' pada bit
-    } else {
-        regs[u8currentRegister] &= ~(1 << u8currentBit); // Menulis '0' pada bit
-    }
-
-    // Mengatur ukuran buffer
-    modbus->u8BufferSize = 6;
-    u8CopyBufferSize = modbus->u8BufferSize + 2;
-
-    // Mengirim buffer ke port serial
-    modbus->sendTxBuffer(modbus);
-
-    return u8CopyBufferSize;
+    return Modbus_process(modbus, regs, u8size);
 }
 
-// Implementasi process_FC6 untuk Modbus dalam C
 int8_t Modbus_process_FC6(Modbus* modbus, uint16_t* regs, uint8_t u8size) {
-    uint8_t u8add = (modbus->au8Buffer[ADD_HI] << 8) | modbus->au8Buffer[ADD_LO];
-    uint8_t u8CopyBufferSize;
-    uint16_t u16val = (modbus->au8Buffer[NB_HI] << 8) | modbus->au8Buffer[NB_LO];
-
-    // Menulis nilai register
-    regs[u8add] = u16val;
-
-    // Mengatur ukuran buffer untuk respons
-    modbus->u8BufferSize = RESPONSE_SIZE;
-
-    u8CopyBufferSize = modbus->u8BufferSize + 2;
-
-    // Mengirim buffer ke port serial
-    modbus->sendTxBuffer(modbus);
-
-    return u8CopyBufferSize;
+    return Modbus_process(modbus, regs, u8size);
 }
 
-// Implementasi process_FC15 untuk Modbus dalam C
 int8_t Modbus_process_FC15(Modbus* modbus, uint16_t* regs, uint8_t u8size) {
-    uint8_t u8currentRegister, u8currentBit, u8frameByte, u8bitsno;
-    uint8_t u8CopyBufferSize;
-    uint16_t u16currentCoil, u16coil;
-    bool bTemp;
-
-    // Menggabungkan dua byte untuk mendapatkan alamat awal coil
-    uint16_t u16StartCoil = (modbus->au8Buffer[ADD_HI] << 8) | modbus->au8Buffer[ADD_LO];
-    uint16_t u16Coilno = (modbus->au8Buffer[NB_HI] << 8) | modbus->au8Buffer[NB_LO];
-
-    // Inisialisasi untuk memulai penulisan bit
-    u8bitsno = 0;
-    u8frameByte = 7;  // Posisi byte data pertama untuk coil
-
-    // Perulangan untuk memproses setiap coil yang harus diperbarui
-    for (u16currentCoil = 0; u16currentCoil < u16Coilno; u16currentCoil++) {
-        u16coil = u16StartCoil + u16currentCoil;
-        u8currentRegister = (uint8_t)(u16coil / 16);  // Menghitung register saat ini
-        u8currentBit = (uint8_t)(u16coil % 16);       // Menghitung posisi bit dalam register
-
-        // Membaca bit dari buffer dan menyimpannya dalam `bTemp`
-        bTemp = (modbus->au8Buffer[u8frameByte] & (1 << u8bitsno)) != 0;
-
-        // Menulis nilai bit ke register yang sesuai
-        if (bTemp) {
-            regs[u8currentRegister] |= (1 << u8currentBit);  // Menulis '1' pada bit
-        } else {
-            regs[u8currentRegister] &= ~(1 << u8currentBit); // Menulis '0' pada bit
-        }
-
-        // Mengatur bit index
-        u8bitsno++;
-
-        // Jika sudah mencapai 8 bit, pindah ke byte berikutnya
-        if (u8bitsno > 7) {
-            u8bitsno = 0;
-            u8frameByte++;
-        }
-    }
-
-    // Mengatur ukuran buffer respons
-    modbus->u8BufferSize = 6;
-    u8CopyBufferSize = modbus->u8BufferSize + 2;
-
-    // Mengirim buffer ke port serial
-    modbus->sendTxBuffer(modbus);
-
-    return u8CopyBufferSize;
+    return Modbus_process(modbus, regs, u8size);
 }
 
-// Implementasi process_FC16 untuk Modbus dalam C
 int8_t Modbus_process_FC16(Modbus* modbus, uint16_t* regs, uint8_t u8size) {
-    uint16_t u16StartAdd = (modbus->au8Buffer[ADD_HI] << 8) | modbus->au8Buffer[ADD_LO];
-    uint16_t u16regsno = (modbus->au8Buffer[NB_HI] << 8) | modbus->au8Buffer[NB_LO];
-    uint8_t u8CopyBufferSize;
-    uint8_t i;
-    uint16_t temp;
-
-    // Mengatur buffer respons untuk jumlah register yang di-update
-    modbus->au8Buffer[NB_HI] = 0;
-    modbus->au8Buffer[NB_LO] = (uint8_t)u16regsno;
-    modbus->u8BufferSize = RESPONSE_SIZE;
-
-    // Mengisi nilai register dengan data yang diterima dari buffer
-    for (i = 0; i < u16regsno; i++) {
-        temp = (modbus->au8Buffer[(BYTE_CNT + 1) + i * 2] << 8) |
-               (modbus->au8Buffer[(BYTE_CNT + 2) + i * 2]);
-        
-        regs[u16StartAdd + i] = temp;
-    }
-
-    // Menghitung ukuran buffer untuk respons
-    u8CopyBufferSize = modbus->u8BufferSize + 2;
-
-    // Mengirim buffer ke port serial
-    modbus->sendTxBuffer(modbus);
-
-    return u8CopyBufferSize;
+    return Modbus_process(modbus, regs, u8size);
 }
+
+void Modbus_end(Modbus* modbus) {
+    modbus->u8state = COM_IDLE;
+    modbus->u8BufferSize = 0;
+    Modbus_closeSerial(modbus);
+    Modbus_setDirNone(modbus);
+}
+
+const ModbusOps Modbus_ops = {
+    .sendTxBuffer = Modbus_sendTxBuffer,
+    .getRxBuffer = Modbus_getRxBuffer,
+    .calcCRC = Modbus_calcCRC,
+    .validateAnswer = Modbus_validateAnswer,
+    .validateRequest = Modbus_validateRequest,
+    .get_FC1 = Modbus_get_FC1,
+    .get_FC3 = Modbus_get_FC3,
+    .process_FC1 = Modbus_process_FC1,
+    .process_FC3 = Modbus_process_FC3,
+    .process_FC5 = Modbus_process_FC5,
+    .process_FC6 = Modbus_process_FC6,
+    .process_FC15 = Modbus_process_FC15,
+    .process_FC16 = Modbus_process_FC16,
+    .buildException = Modbus_buildException,
+
+    .start = Modbus_start,
+    .setTimeOut = Modbus_setTimeOut,
+    .getTimeOut = Modbus_getTimeOut,
+    .getTimeOutState = Modbus_getTimeOutState,
+    .query = Modbus_query,
+    .poll = Modbus_poll,
+    .pollWithRegs = Modbus_pollWithRegs,
+    .getInCnt = Modbus_getInCnt,
+    .getOutCnt = Modbus_getOutCnt,
+    .getErrCnt = Modbus_getErrCnt,
+    .getID = Modbus_getID,
+    .getState = Modbus_getState,
+    .getLastError = Modbus_getLastError,
+    .setID = Modbus_setID,
+    .setTxendPinOverTime = Modbus_setTxendPinOverTime,
+    .end = Modbus_end
+};
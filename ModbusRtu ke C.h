@@ -4,41 +4,13 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include "ModbusCore.h"
 
-typedef struct {
-    uint8_t u8id;
-    uint8_t u8fct;
-    uint16_t u16RegAdd;
-    uint16_t u16CoilsNo;
-    uint16_t *au16reg;
-} modbus_t;
-
-enum {
-    RESPONSE_SIZE = 6,
-    EXCEPTION_SIZE = 3,
-    CHECKSUM_SIZE = 2
-};
-
-enum MESSAGE {
-    ID = 0,
-    FUNC,
-    ADD_HI,
-    ADD_LO,
-    NB_HI,
-    NB_LO,
-    BYTE_CNT
-};
-
-enum MB_FC {
-    MB_FC_NONE = 0,
-    MB_FC_READ_COILS = 1,
-    MB_FC_READ_DISCRETE_INPUT = 2,
-    MB_FC_READ_REGISTERS = 3,
-    MB_FC_READ_INPUT_REGISTER = 4,
-    MB_FC_WRITE_COIL = 5,
-    MB_FC_WRITE_REGISTER = 6,
-    MB_FC_WRITE_MULTIPLE_COILS = 15,
-    MB_FC_WRITE_MULTIPLE_REGISTERS = 16
+// Paritas port serial; tanpa paritas memakai 2 stop bit agar karakter tetap 11 bit
+enum SERIAL_PARITY {
+    PARITY_NONE = 0,
+    PARITY_EVEN = 1,
+    PARITY_ODD = 2
 };
 
 enum COM_STATES {
@@ -46,51 +18,13 @@ enum COM_STATES {
     COM_WAITING = 1
 };
 
-enum ERR_LIST {
-    ERR_NOT_MASTER = -1,
-    ERR_POLLING = -2,
-    ERR_BUFF_OVERFLOW = -3,
-    ERR_BAD_CRC = -4,
-    ERR_EXCEPTION = -5
-};
-
-enum {
-    NO_REPLY = 255,
-    EXC_FUNC_CODE = 1,
-    EXC_ADDR_RANGE = 2,
-    EXC_REGS_QUANT = 3,
-    EXC_EXECUTE = 4
-};
-
-static const unsigned char fctsupported[] = {
-    MB_FC_READ_COILS,
-    MB_FC_READ_DISCRETE_INPUT,
-    MB_FC_READ_REGISTERS,
-    MB_FC_READ_INPUT_REGISTER,
-    MB_FC_WRITE_COIL,
-    MB_FC_WRITE_REGISTER,
-    MB_FC_WRITE_MULTIPLE_COILS,
-    MB_FC_WRITE_MULTIPLE_REGISTERS
-};
-
-#define T35 5
 #define MAX_BUFFER 64
 
-typedef struct Modbus {
-    FILE *port;
-    uint8_t u8id;
-    uint8_t u8txenpin;
-    uint8_t u8state;
-    uint8_t u8lastError;
-    uint8_t au8Buffer[MAX_BUFFER];
-    uint8_t u8BufferSize;
-    uint8_t u8lastRec;
-    uint16_t *au16regs;
-    uint16_t u16InCnt, u16OutCnt, u16errCnt;
-    uint16_t u16timeOut;
-    uint32_t u32time, u32timeOut, u32overTime;
-    uint8_t u8regsize;
+struct Modbus;
 
+// Tabel operasi: satu tabel const dipakai bersama oleh semua instance,
+// sehingga tiap instance hanya membawa satu pointer ke sini
+typedef struct ModbusOps {
     void (*sendTxBuffer)(struct Modbus*);
     int8_t (*getRxBuffer)(struct Modbus*);
     uint16_t (*calcCRC)(struct Modbus*, uint8_t u8length);
@@ -122,10 +56,66 @@ typedef struct Modbus {
     void (*setID)(struct Modbus*, uint8_t u8id);
     void (*setTxendPinOverTime)(struct Modbus*, uint32_t u32overTime);
     void (*end)(struct Modbus*);
+} ModbusOps;
+
+extern const ModbusOps Modbus_ops;
+
+// Kendali arah RS-485: transmit sebelum byte pertama, receive setelah stop bit
+// terakhir keluar. NULL berarti backend tidak perlu dipanggil (tanpa
+// transceiver, atau driver kernel yang mengatur RTS sendiri)
+typedef struct ModbusDir {
+    void (*transmit)(struct Modbus*);
+    void (*receive)(struct Modbus*);
+} ModbusDir;
+
+extern const ModbusDir ModbusDir_none;     // RS-232/USB, tanpa jalur arah
+extern const ModbusDir ModbusDir_callback; // memanggil fungsi dari Modbus_setDirCallback
+extern const ModbusDir ModbusDir_gpio;     // GPIO character device Linux (/dev/gpiochipN)
+extern const ModbusDir ModbusDir_rs485;    // mode RS-485 kernel (TIOCSRS485), RTS otomatis
+
+// Status per instance; field yang dipakai tiap poll diletakkan di depan
+typedef struct Modbus {
+    const ModbusOps *ops;
+    int fd; // file descriptor serial non-blocking, -1 jika belum dibuka
+    const ModbusDir *dir; // backend arah RS-485
+    int dirFd; // line handle GPIO, -1 jika tidak dipakai
+    uint8_t u8id;
+    uint8_t u8txenpin;
+    uint8_t u8state;
+    uint8_t u8lastError;
+    uint8_t u8BufferSize;
+    uint8_t u8regsize;
+    modbus_rx_t rx; // frame yang sedang diterima ke au8Buffer
+    uint16_t u16timeOut;
+    uint16_t u16InCnt, u16OutCnt, u16errCnt;
+    uint32_t u32time, u32timeOut;
+    uint32_t u32overTime; // jeda tambahan dalam us setelah stop bit terakhir sebelum jalur dilepas
+    uint32_t u32T35; // jeda antar frame dalam us
+    uint32_t u32char; // waktu satu karakter 11 bit dalam us
+    uint16_t *au16regs;
+    uint16_t u16queryNo; // jumlah coil/register yang dibaca query ke au16regs
+
+    uint32_t (*clock)(struct Modbus*); // sumber waktu dalam us, NULL = micros()
+    uint32_t u32clockUs, u32clockMs, u32clockRem;
+    void (*dirCallback)(struct Modbus*, bool bTransmit); // untuk ModbusDir_callback
+
+    uint8_t au8Buffer[MAX_BUFFER];
 } Modbus;
 
-Modbus* Modbus_new(uint8_t u8id, FILE* port, uint8_t u8txenpin);
+void Modbus_init(Modbus* modbus, uint8_t u8id, int fd, uint8_t u8txenpin);
+Modbus* Modbus_new(uint8_t u8id, int fd, uint8_t u8txenpin);
 void Modbus_delete(Modbus* modbus);
+void Modbus_setBaudRate(Modbus* modbus, long u32speed);
+int Modbus_openSerial(Modbus* modbus, const char *path, long u32speed, uint8_t u8parity);
+void Modbus_closeSerial(Modbus* modbus);
+uint8_t Modbus_available(Modbus* modbus);
+void Modbus_setClock(Modbus* modbus, uint32_t (*clock)(struct Modbus*));
+uint32_t Modbus_micros(Modbus* modbus);
+uint32_t Modbus_millis(Modbus* modbus);
+void Modbus_setDirNone(Modbus* modbus);
+void Modbus_setDirCallback(Modbus* modbus, void (*callback)(struct Modbus*, bool bTransmit));
+int Modbus_setDirGpio(Modbus* modbus, const char *chip, uint32_t u32line, bool bActiveLow);
+int Modbus_setDirRs485(Modbus* modbus, uint32_t u32delayBefore, uint32_t u32delayAfter); // jeda RTS dalam ms
 
 #endif // MODBUS_RTU_H
 
@@ -1,4 +1,7 @@
 #include <ModbusRtu.h>
+#include <ModbusCrc.h>
+#include <ModbusRegs.h>
+
 Modbus::Modbus(uint8_t u8id, Stream& port, uint8_t u8txenpin)
 {
     this->port = &port;
@@ -6,6 +9,28 @@ Modbus::Modbus(uint8_t u8id, Stream& port, uint8_t u8txenpin)
     this->u8txenpin = u8txenpin;
     this->u16timeOut = 1000;
     this->u32overTime = 0;
+    this->u32T35 = T35 * 1000UL;
+    this->u32char = this->u32T35 * 2 / 7;
+    this->bAsyncTx = false;
+    this->txHandler = NULL;
+    memset( this->au8userMap, 0, sizeof( this->au8userMap ) );
+    memset( this->au8userFct, 0, sizeof( this->au8userFct ) );
+    this->aslaves = NULL;
+    this->pslave = NULL;
+    this->u8slaves = 0;
+    this->u8qFails = 0;
+    this->pregmap = NULL;
+    this->pbanks = NULL;
+    this->pseqlock = NULL;
+    this->writeHandler = NULL;
+    this->achanges = NULL;
+    this->u8changes = 0;
+    this->acache = NULL;
+    this->u8cache = 0;
+    this->pcacheSource = NULL;
+    this->u16cacheSize = 0;
+    this->quarantineHandler = NULL;
+    this->clockSource = NULL;
 }
 
 Modbus::Modbus(uint8_t u8id, uint8_t u8serno, uint8_t u8txenpin)
@@ -14,6 +39,28 @@ Modbus::Modbus(uint8_t u8id, uint8_t u8serno, uint8_t u8txenpin)
     this->u8txenpin = u8txenpin;
     this->u16timeOut = 1000;
     this->u32overTime = 0;
+    this->u32T35 = T35 * 1000UL;
+    this->u32char = this->u32T35 * 2 / 7;
+    this->bAsyncTx = false;
+    this->txHandler = NULL;
+    memset( this->au8userMap, 0, sizeof( this->au8userMap ) );
+    memset( this->au8userFct, 0, sizeof( this->au8userFct ) );
+    this->aslaves = NULL;
+    this->pslave = NULL;
+    this->u8slaves = 0;
+    this->u8qFails = 0;
+    this->pregmap = NULL;
+    this->pbanks = NULL;
+    this->pseqlock = NULL;
+    this->writeHandler = NULL;
+    this->achanges = NULL;
+    this->u8changes = 0;
+    this->acache = NULL;
+    this->u8cache = 0;
+    this->pcacheSource = NULL;
+    this->u16cacheSize = 0;
+    this->quarantineHandler = NULL;
+    this->clockSource = NULL;
 
     switch( u8serno )
     {
@@ -51,7 +98,10 @@ void Modbus::start()
     }
 
     while(port->read() >= 0);
-    u8lastRec = u8BufferSize = 0;
+    u16BufferSize = 0;
+    rx.u8state = RX_IDLE;
+    rx.u16expected = 0;
+    u8state = COM_IDLE;
     u16InCnt = u16OutCnt = u16errCnt = 0;
 }
 
@@ -60,6 +110,7 @@ void Modbus::begin(T_Stream* install_port, long u32speed)
 {
     port = install_port;
     install_port->begin(u32speed);
+    setBaudRate(u32speed);
     start();
 }
 
@@ -69,12 +120,14 @@ void Modbus::begin(T_Stream* install_port, long u32speed, uint8_t u8txenpin)
     this->u8txenpin = u8txenpin;
     this->port = install_port;
     install_port->begin(u32speed);
+    setBaudRate(u32speed);
     start();
 }
 
 void Modbus::begin(long u32speed)
 {
     static_cast<HardwareSerial*>(port)->begin(u32speed);
+    setBaudRate(u32speed);
     start();
 }
 
@@ -83,6 +136,7 @@ void Modbus::setID( uint8_t u8id)
     if (( u8id != 0) && (u8id <= 247))
     {
         this->u8id = u8id;
+        setResponseCache( acache, u8cache ); // cached answers carry the old ID
     }
 }
 
@@ -91,6 +145,50 @@ void Modbus::setTxendPinOverTime( uint32_t u32overTime )
     this->u32overTime = u32overTime;
 }
 
+void Modbus::setBaudRate( uint32_t u32speed )
+{
+    ModbusCore_timing( u32speed, &u32T35, &u32char );
+}
+
+void Modbus::setAsyncTx( boolean bAsync )
+{
+    this->bAsyncTx = bAsync;
+}
+
+void Modbus::setTxHandler( modbus_txdone_t handler )
+{
+    this->txHandler = handler;
+}
+
+void Modbus::setClock( modbus_clock_t clock )
+{
+    // every timeout, T3.5 check and probe interval reads the time through here
+    this->clockSource = clock;
+    if (clock == NULL) return;
+    this->u32clockUs = clock();
+    this->u32clockMs = 0;
+    this->u32clockRem = 0;
+}
+
+uint32_t Modbus::getMicros()
+{
+    if (clockSource == NULL) return micros();
+    return clockSource();
+}
+
+uint32_t Modbus::getMillis()
+{
+    if (clockSource == NULL) return millis();
+
+    // count ms from the us steps so the value wraps at 2^32 like millis()
+    uint32_t u32now = clockSource();
+    u32clockRem += u32now - u32clockUs;
+    u32clockUs = u32now;
+    u32clockMs += u32clockRem / 1000;
+    u32clockRem %= 1000;
+    return u32clockMs;
+}
+
 uint8_t Modbus::getID()
 {
     return this->u8id;
@@ -101,9 +199,72 @@ void Modbus::setTimeOut( uint16_t u16timeOut)
     this->u16timeOut = u16timeOut;
 }
 
+uint16_t Modbus::getTimeOut()
+{
+    return u16timeOut;
+}
+
+void Modbus::setAdaptiveTimeOut( modbus_slave_t *slaves, uint8_t u8slaves, uint16_t u16floor, uint16_t u16ceiling )
+{
+    this->aslaves = slaves;
+    this->u8slaves = (slaves != NULL) ? u8slaves : 0;
+    this->u8slaveNext = 0;
+    this->u16toFloor = u16floor;
+    this->u16toCeiling = (u16ceiling < u16floor) ? u16floor : u16ceiling;
+    for (uint8_t i = 0; i < this->u8slaves; i++) slaves[ i ].u8id = 0;
+}
+
+modbus_slave_t *Modbus::getSlave( uint8_t u8id )
+{
+    for (uint8_t i = 0; i < u8slaves; i++)
+    {
+        if (aslaves[ i ].u8id == u8id) return &aslaves[ i ];
+    }
+    return NULL;
+}
+
+boolean Modbus::setQuarantine( uint8_t u8fails, uint16_t u16probeMin, uint16_t u16probeMax )
+{
+    // misses and back-off are tracked in the per-slave table
+    if (u8slaves == 0) return false;
+
+    this->u8qFails = u8fails;
+    this->u16probeMin = (u16probeMin == 0) ? 1 : u16probeMin;
+    this->u16probeMax = (u16probeMax < this->u16probeMin) ? this->u16probeMin : u16probeMax;
+    return true;
+}
+
+void Modbus::setQuarantineHandler( modbus_quarantine_t handler )
+{
+    this->quarantineHandler = handler;
+}
+
+boolean Modbus::isQuarantined( uint8_t u8id )
+{
+    modbus_slave_t *slave = getSlave( u8id );
+    return (slave != NULL && slave->u8backoff != 0);
+}
+
+modbus_slave_t *Modbus::getQuarantined( uint8_t u8index )
+{
+    for (uint8_t i = 0; i < u8slaves; i++)
+    {
+        if (aslaves[ i ].u8id == 0 || aslaves[ i ].u8backoff == 0) continue;
+        if (u8index == 0) return &aslaves[ i ];
+        u8index--;
+    }
+    return NULL;
+}
+
 boolean Modbus::getTimeOutState()
 {
-    return ((unsigned long)(millis() -u32timeOut) > (unsigned long)u16timeOut);
+    return ((unsigned long)(getMillis() -u32timeOut) > (unsigned long)u16timeOut);
+}
+
+boolean Modbus::isReady()
+{
+    if (u8state != COM_IDLE || rx.u8state != RX_IDLE) return false;
+    return ((unsigned long)(getMicros() -u32time) >= (unsigned long)u32T35);
 }
 
 uint16_t Modbus::getInCnt()
@@ -133,176 +294,96 @@ uint8_t Modbus::getLastError()
 
 int8_t Modbus::query( modbus_t telegram )
 {
-    uint8_t u8regsno, u8bytesno;
+    uint16_t u16expected;
     if (u8id!=0) return -2;
     if (u8state != COM_IDLE) return -1;
 
     if ((telegram.u8id==0) || (telegram.u8id>247)) return -3;
 
-    au16regs = telegram.au16reg;
-
-    au8Buffer[ ID ]         = telegram.u8id;
-    au8Buffer[ FUNC ]       = telegram.u8fct;
-    au8Buffer[ ADD_HI ]     = highByte(telegram.u16RegAdd );
-    au8Buffer[ ADD_LO ]     = lowByte( telegram.u16RegAdd );
-
-    switch( telegram.u8fct )
-    {
-    case MB_FC_READ_COILS:
-    case MB_FC_READ_DISCRETE_INPUT:
-    case MB_FC_READ_REGISTERS:
-    case MB_FC_READ_INPUT_REGISTER:
-        au8Buffer[ NB_HI ]      = highByte(telegram.u16CoilsNo );
-        au8Buffer[ NB_LO ]      = lowByte( telegram.u16CoilsNo );
-        u8BufferSize = 6;
-        break;
-    case MB_FC_WRITE_COIL:
-        au8Buffer[ NB_HI ]      = ((au16regs[0] > 0) ? 0xff : 0);
-        au8Buffer[ NB_LO ]      = 0;
-        u8BufferSize = 6;
-        break;
-    case MB_FC_WRITE_REGISTER:
-        au8Buffer[ NB_HI ]      = highByte(au16regs[0]);
-        au8Buffer[ NB_LO ]      = lowByte(au16regs[0]);
-        u8BufferSize = 6;
-        break;
-    case MB_FC_WRITE_MULTIPLE_COILS: // TODO: implement "sending coils"
-        u8regsno = telegram.u16CoilsNo / 16;
-        u8bytesno = u8regsno * 2;
-        if ((telegram.u16CoilsNo % 16) != 0)
-        {
-            u8bytesno++;
-            u8regsno++;
-        }
-
-        au8Buffer[ NB_HI ]      = highByte(telegram.u16CoilsNo );
-        au8Buffer[ NB_LO ]      = lowByte( telegram.u16CoilsNo );
-        au8Buffer[ BYTE_CNT ]    = u8bytesno;
-        u8BufferSize = 7;
-
-        for (uint16_t i = 0; i < u8bytesno; i++)
-        {
-            if(i%2)
-            {
-                au8Buffer[ u8BufferSize ] = lowByte( au16regs[ i/2 ] );
-            }
-            else
-            {
-                au8Buffer[ u8BufferSize ] = highByte( au16regs[ i/2] );
-            }          
-            u8BufferSize++;
-        }
-        break;
-
-    case MB_FC_WRITE_MULTIPLE_REGISTERS:
-        au8Buffer[ NB_HI ]      = highByte(telegram.u16CoilsNo );
-        au8Buffer[ NB_LO ]      = lowByte( telegram.u16CoilsNo );
-        au8Buffer[ BYTE_CNT ]    = (uint8_t) ( telegram.u16CoilsNo * 2 );
-        u8BufferSize = 7;
+    // a quarantined slave only gets a probe once its back-off has elapsed
+    pslave = findSlave( telegram.u8id );
+    if (pslave != NULL && pslave->u8backoff != 0 &&
+        (int32_t)(getMillis() - pslave->u32probe) < 0) return ERR_QUARANTINED;
 
-        for (uint16_t i=0; i< telegram.u16CoilsNo; i++)
-        {
-            au8Buffer[ u8BufferSize ] = highByte( au16regs[ i ] );
-            u8BufferSize++;
-            au8Buffer[ u8BufferSize ] = lowByte( au16regs[ i ] );
-            u8BufferSize++;
-        }
-        break;
-    }
+    int16_t i16length = ModbusCore_query( au8Buffer, MAX_BUFFER, &telegram, &u16expected );
+    if (i16length < 0) return i16length;
+    au16regs = telegram.au16reg;
+    u16queryNo = telegram.u16CoilsNo;
+    u16BufferSize = i16length;
 
-    sendTxBuffer();
     u8state = COM_WAITING;
+    sendTxBuffer();
+    rx.u16expected = u16expected;
+    u32queryTime = u32time;
+    if (pslave != NULL)
+        u32rxTimeOut = pslave->u32timeOut;
+    else
+        u32rxTimeOut = u16timeOut * 1000UL;
     u8lastError = 0;
     return 0;
 }
 
-int8_t Modbus::poll()
+int16_t Modbus::poll()
 {
-	uint8_t u8current;
-    u8current = port->available();
+    if (!pollTx()) return 0;
 
-    if ((unsigned long)(millis() -u32timeOut) > (unsigned long)u16timeOut)
+    // the timeout covers the slave turnaround; once the answer starts it ends on its own
+    if (u8state == COM_WAITING && rx.u8state == RX_IDLE && !port->available() &&
+        (unsigned long)(getMicros() -u32queryTime) > (unsigned long)u32rxTimeOut)
     {
         u8state = COM_IDLE;
         u8lastError = NO_REPLY;
+        rx.u16expected = 0;
         u16errCnt++;
+        updateSlave( pslave, false );
         return 0;
     }
 
-    if (u8current == 0) return 0;
-
-    if (u8current != u8lastRec)
-    {
-        u8lastRec = u8current;
-        u32time = millis();
-        return 0;
-    }
-    if ((unsigned long)(millis() -u32time) < (unsigned long)T35) return 0;
-
-    u8lastRec = 0;
-    int8_t i8state = getRxBuffer();
-    if (i8state < 6) //7 was incorrect for functions 1 and 2 the smallest frame could be 6 bytes long
+    int16_t i16state = getRxBuffer();
+    if (i16state == 0) return 0;
+    rx.u16expected = 0;
+    if (i16state < EXCEPTION_SIZE + CHECKSUM_SIZE) // an exception answer is the shortest frame
     {
         u8state = COM_IDLE;
+        u8lastError = (i16state < 0) ? (uint8_t)i16state : (uint8_t)ERR_BAD_SIZE;
         u16errCnt++;
-        return i8state;
+        return i16state;
     }
 
+    // a corrupted frame may not even come from this slave
     uint8_t u8exception = validateAnswer();
+    if (u8exception != (uint8_t)ERR_BAD_CRC) updateSlave( pslave, true );
     if (u8exception != 0)
     {
         u8state = COM_IDLE;
-        return u8exception;
+        u8lastError = u8exception;
+        return (int8_t)u8exception; // the ERR_LIST codes stay negative
     }
 
-    switch( au8Buffer[ FUNC ] )
+    // copy read answers to au16regs; user function codes are left in the buffer
+    u8state = COM_IDLE;
+    int8_t i8answer = ModbusCore_getAnswer( au8Buffer, au16regs, u16queryNo );
+    if (i8answer != 0)
     {
-    case MB_FC_READ_COILS:
-    case MB_FC_READ_DISCRETE_INPUT:
-        // call get_FC1 to transfer the incoming message to au16regs buffer
-        get_FC1( );
-        break;
-    case MB_FC_READ_INPUT_REGISTER:
-    case MB_FC_READ_REGISTERS :
-        // call get_FC3 to transfer the incoming message to au16regs buffer
-        get_FC3( );
-        break;
-    case MB_FC_WRITE_COIL:
-    case MB_FC_WRITE_REGISTER :
-    case MB_FC_WRITE_MULTIPLE_COILS:
-    case MB_FC_WRITE_MULTIPLE_REGISTERS :
-        // nothing to do
-        break;
-    default:
-        break;
+        u8lastError = (uint8_t)i8answer;
+        u16errCnt++;
+        return i8answer;
     }
-    u8state = COM_IDLE;
-    return u8BufferSize;
+    return u16BufferSize;
 }
 
-int8_t Modbus::poll( uint16_t *regs, uint8_t u8size )
+int16_t Modbus::poll( uint16_t *regs, uint16_t u16size )
 {
+    if (!pollTx()) return 0;
 
     au16regs = regs;
-    u8regsize = u8size;
-	uint8_t u8current;
-
-    u8current = port->available();
+    u16regsize = u16size;
+    u32bitsize = (uint32_t)u16size * 16; // coils alias the registers
 
-    if (u8current == 0) return 0;
-
-    if (u8current != u8lastRec)
-    {
-        u8lastRec = u8current;
-        u32time = millis();
-        return 0;
-    }
-    if ((unsigned long)(millis() -u32time) < (unsigned long)T35) return 0;
-
-    u8lastRec = 0;
-    int8_t i8state = getRxBuffer();
-    u8lastError = i8state;
-    if (i8state < 7) return i8state;
+    int16_t i16state = getRxBuffer();
+    if (i16state == 0) return 0;
+    u8lastError = i16state;
+    if (i16state < 2 + CHECKSUM_SIZE) return i16state; // ID and FUNC at least
 
     // check slave id
     if (au8Buffer[ ID ] != u8id) return 0;
@@ -317,79 +398,150 @@ int8_t Modbus::poll( uint16_t *regs, uint8_t u8size )
             sendTxBuffer();
         }
         u8lastError = u8exception;
-        return u8exception;
+        return (int8_t)u8exception;
     }
 
-    u32timeOut = millis();
+    u32timeOut = getMillis();
     u8lastError = 0;
 
     // process message
-    switch( au8Buffer[ FUNC ] )
+    modbus_handler_t handler = getHandler( au8Buffer[ FUNC ] );
+    if (handler == NULL && au8Buffer[ FUNC ] <= MB_FC_READ_INPUT_REGISTER && u8cache != 0)
     {
-    case MB_FC_READ_COILS:
-    case MB_FC_READ_DISCRETE_INPUT:
-        return process_FC1( regs, u8size );
-        break;
-    case MB_FC_READ_INPUT_REGISTER:
-    case MB_FC_READ_REGISTERS :
-        return process_FC3( regs, u8size );
-        break;
-    case MB_FC_WRITE_COIL:
-        return process_FC5( regs, u8size );
-        break;
-    case MB_FC_WRITE_REGISTER :
-        return process_FC6( regs, u8size );
-        break;
-    case MB_FC_WRITE_MULTIPLE_COILS:
-        return process_FC15( regs, u8size );
-        break;
-    case MB_FC_WRITE_MULTIPLE_REGISTERS :
-        return process_FC16( regs, u8size );
-        break;
-    default:
-        break;
+        // reads: replay the cached answer or cache the one we build
+        uint8_t u8fct = au8Buffer[ FUNC ];
+        uint16_t u16add = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ] );
+        uint16_t u16no = word( au8Buffer[ NB_HI ], au8Buffer[ NB_LO ] );
+
+        // answers packed from another array, map or bank set are stale
+        const void *psource = (pregmap != NULL) ? (const void *)pregmap :
+                              (pbanks != NULL) ? (const void *)pbanks : (const void *)regs;
+        if (psource != pcacheSource || u16size != u16cacheSize)
+        {
+            setResponseCache( acache, u8cache );
+            pcacheSource = psource;
+            u16cacheSize = u16size;
+        }
+
+        modbus_cache_t *entry = findCache( u8fct, u16add, u16no );
+        if (entry != NULL)
+        {
+            transmit( entry->au8frame, entry->u16length );
+            return entry->u16length;
+        }
+        int16_t i16answer = process();
+        if (i16answer > 0) storeCache( u8fct, u16add, u16no, i16answer );
+        return i16answer;
     }
-    return i8state;
+    if (handler != NULL)
+    {
+        // the handler may change any data behind the cached reads
+        if (au8Buffer[ FUNC ] > MB_FC_READ_INPUT_REGISTER && u8cache != 0) setResponseCache( acache, u8cache );
+        int16_t i16answer = handler( au8Buffer, u16BufferSize - CHECKSUM_SIZE, regs, u16size );
+        if (i16answer == 0) return 0;
+        if (i16answer < 0)
+        {
+            u8lastError = (uint8_t) -i16answer;
+            buildException( u8lastError );
+        }
+        else if (i16answer > MAX_BUFFER - CHECKSUM_SIZE)
+        {
+            // no room left for the CRC: report a slave device failure instead
+            u8lastError = EXC_EXECUTE;
+            buildException( EXC_EXECUTE );
+        }
+        else u16BufferSize = i16answer;
+        i16answer = u16BufferSize + CHECKSUM_SIZE;
+        sendTxBuffer();
+        return i16answer;
+    }
+    return process();
 }
 
-int8_t Modbus::getRxBuffer()
+int16_t Modbus::poll( ModbusRegisterMap &map )
 {
-    boolean bBuffOverflow = false;
+    pregmap = &map;
+    int16_t i16state = poll( NULL, 0 );
+    pregmap = NULL;
+    return i16state;
+}
 
-    if (u8txenpin > 1) digitalWrite( u8txenpin, LOW );
+int16_t Modbus::poll( const modbus_banks_t &banks )
+{
+    pbanks = &banks;
+    int16_t i16state = poll( NULL, 0 );
+    pbanks = NULL;
+    return i16state;
+}
 
-    u8BufferSize = 0;
-    while ( port->available() )
+int16_t Modbus::getRxBuffer()
+{
+    uint32_t u32now = getMicros();
+
+    if (port->available())
     {
-        au8Buffer[ u8BufferSize ] = port->read();
-        u8BufferSize ++;
+        if (rx.u8state == RX_IDLE)
+        {
+            if (u8txenpin > 1) digitalWrite( u8txenpin, LOW );
+            ModbusCore_rxBegin( &rx );
+            u32rxStart = u32now;
+        }
 
-        if (u8BufferSize >= MAX_BUFFER) bBuffOverflow = true;
+        // consume whatever arrived since the last call, one byte at a time
+        while ( port->available() )
+        {
+            if (ModbusCore_rxByte( &rx, au8Buffer, MAX_BUFFER, port->read() ))
+            {
+                u16BufferSize = rx.u16length;
+                u32time = u32now;
+                u16InCnt++;
+                return u16BufferSize;
+            }
+        }
+        u32time = u32now;
+        return 0;
     }
-    u16InCnt++;
 
-    if (bBuffOverflow)
-    {
-        u16errCnt++;
-        return ERR_BUFF_OVERFLOW;
-    }
-    return u8BufferSize;
+    // a frame ends after T3.5 of silence behind its last byte
+    if (rx.u8state == RX_IDLE) return 0;
+    if ((unsigned long)(u32now - u32time) < (unsigned long)u32T35) return 0;
+
+    int16_t i16length = ModbusCore_rxEnd( &rx );
+    u16BufferSize = rx.u16length;
+    u16InCnt++;
+    if (i16length < 0) u16errCnt++;
+    return i16length;
 }
 
 void Modbus::sendTxBuffer()
 {
-    uint16_t u16crc = calcCRC( u8BufferSize );
-    au8Buffer[ u8BufferSize ] = u16crc >> 8;
-    u8BufferSize++;
-    au8Buffer[ u8BufferSize ] = u16crc & 0x00ff;
-    u8BufferSize++;
+    u16BufferSize = ModbusCore_seal( au8Buffer, u16BufferSize );
+    transmit( au8Buffer, u16BufferSize );
+}
 
+void Modbus::transmit( const uint8_t *au8frame, uint16_t u16length )
+{
     if (u8txenpin > 1)
     {
         digitalWrite( u8txenpin, HIGH );
     }
 
-    port->write( au8Buffer, u8BufferSize );
+    port->write( au8frame, u16length );
+    u16OutCnt++;
+    u16txLength = u16length;
+    u16BufferSize = 0;
+    rx.u8state = RX_IDLE;
+    u32timeOut = getMillis();
+
+    if (bAsyncTx)
+    {
+        // the UART drains on its own; pollTx() releases the line once the
+        // last stop bit is out instead of spinning here
+        u32txStart = getMicros();
+        u32txTime = u16txLength * u32char;
+        u8state = COM_SENDING;
+        return;
+    }
 
     if (u8txenpin > 1)
     {
@@ -399,343 +551,737 @@ void Modbus::sendTxBuffer()
         digitalWrite( u8txenpin, LOW );
     }
     while(port->read() >= 0);
+    u32time = getMicros();
+}
+
+boolean Modbus::pollTx()
+{
+    if (u8state != COM_SENDING) return true;
+    if ((unsigned long)(getMicros() -u32txStart) < (unsigned long)u32txTime) return false;
 
-    u8BufferSize = 0;
+    if (u8txenpin > 1)
+    {
+        port->flush();
+        digitalWrite( u8txenpin, LOW );
 
-    u32timeOut = millis();
+        // drop the local echo only; a late loop may already hold the start of the next frame behind it
+        for (uint16_t i = 0; i < u16txLength && port->available(); i++) port->read();
+    }
 
-    u16OutCnt++;
+    // the frame left the line at its computed end, not when this poll ran
+    u32time = u32txStart + u32txTime;
+    u32queryTime = u32time;
+    u8state = (u8id == 0) ? COM_WAITING : COM_IDLE;
+    if (txHandler != NULL) txHandler( u16txLength );
+    return true;
+}
+
+modbus_handler_t Modbus::getHandler( uint8_t u8fct )
+{
+    if ((au8userMap[ u8fct >> 3 ] & (1 << (u8fct & 7))) == 0) return NULL;
+    for (uint8_t i = 0; i < MAX_USER_FCT; i++)
+    {
+        if (au8userFct[ i ] == u8fct) return auserHandler[ i ];
+    }
+    return NULL;
 }
 
-uint16_t Modbus::calcCRC(uint8_t u8length)
+boolean Modbus::setHandler( uint8_t u8fct, modbus_handler_t handler )
 {
-    unsigned int temp, temp2, flag;
-    temp = 0xFFFF;
-    for (unsigned char i = 0; i < u8length; i++)
+    if (u8fct == 0 || (u8fct & 0x80) != 0) return false; // 0x80 marks exceptions
+
+    uint8_t u8free = MAX_USER_FCT;
+    for (uint8_t i = 0; i < MAX_USER_FCT; i++)
     {
-        temp = temp ^ au8Buffer[i];
-        for (unsigned char j = 1; j <= 8; j++)
+        if (au8userFct[ i ] == u8fct)
         {
-            flag = temp & 0x0001;
-            temp >>=1;
-            if (flag)
-                temp ^= 0xA001;
+            u8free = i;
+            break;
         }
+        if (au8userFct[ i ] == 0 && u8free == MAX_USER_FCT) u8free = i;
     }
-    temp2 = temp >> 8;
-    temp = (temp << 8) | temp2;
-    temp &= 0xFFFF;
-    return temp;
+
+    if (handler == NULL)
+    {
+        if (u8free < MAX_USER_FCT && au8userFct[ u8free ] == u8fct) au8userFct[ u8free ] = 0;
+        au8userMap[ u8fct >> 3 ] &= ~(1 << (u8fct & 7));
+        return true;
+    }
+    if (u8free == MAX_USER_FCT) return false;
+
+    au8userFct[ u8free ] = u8fct;
+    auserHandler[ u8free ] = handler;
+    au8userMap[ u8fct >> 3 ] |= (1 << (u8fct & 7));
+    return true;
 }
 
 uint8_t Modbus::validateRequest()
 {
-    uint16_t u16MsgCRC =
-        ((au8Buffer[u8BufferSize - 2] << 8)
-         | au8Buffer[u8BufferSize - 1]); // combine the crc Low & High bytes
-    if ( calcCRC( u8BufferSize-2 ) != u16MsgCRC )
+    // the CRC was accumulated in getRxBuffer(); a sound frame leaves no residue
+    if ( rx.u16crc != MODBUS_CRC_RESIDUE )
     {
         u16errCnt ++;
         return NO_REPLY;
     }
 
-    // check fct code
-    boolean isSupported = false;
-    for (uint8_t i = 0; i< sizeof( fctsupported ); i++)
+    // user handlers check their own requests
+    if (getHandler( au8Buffer[ FUNC ] ) != NULL) return 0;
+
+    uint8_t u8exception = ModbusCore_checkRequest( &coreAccess, this, au8Buffer, u16BufferSize, MAX_BUFFER );
+    if (u8exception == EXC_FUNC_CODE || u8exception == NO_REPLY) u16errCnt ++;
+    return u8exception;
+}
+
+uint8_t Modbus::validateAnswer()
+{
+    uint8_t u8exception = ModbusCore_checkAnswer( &rx, au8Buffer );
+
+    // user function codes are left to the application
+    if (u8exception == EXC_FUNC_CODE && getHandler( au8Buffer[ FUNC ] ) != NULL) return 0;
+    if (u8exception != 0) u16errCnt ++;
+    return u8exception;
+}
+
+modbus_slave_t *Modbus::findSlave( uint8_t u8id )
+{
+    if (u8slaves == 0) return NULL;
+
+    modbus_slave_t *slave = getSlave( u8id );
+    if (slave != NULL) return slave;
+
+    // take a free entry, or recycle one round-robin
+    slave = getSlave( 0 );
+    if (slave == NULL)
+    {
+        slave = &aslaves[ u8slaveNext ];
+        u8slaveNext++;
+        if (u8slaveNext >= u8slaves) u8slaveNext = 0;
+    }
+    slave->u8id = u8id;
+    slave->u16samples = 0;
+    slave->u32srtt = 0;
+    slave->u32rttvar = 0;
+    slave->u32timeOut = u16toCeiling * 1000UL;
+    slave->u8fails = 0;
+    slave->u8backoff = 0;
+    return slave;
+}
+
+void Modbus::updateSlave( modbus_slave_t *slave, boolean bAnswered )
+{
+    if (slave == NULL) return;
+
+    uint32_t u32floor = u16toFloor * 1000UL;
+    uint32_t u32ceiling = u16toCeiling * 1000UL;
+
+    updateQuarantine( slave, bAnswered );
+    if (bAnswered)
     {
-        if (fctsupported[i] == au8Buffer[FUNC])
+        // smoothed latency and deviation as in RFC 6298; srtt + 4*rttvar
+        // sits above the high percentiles of the observed turnaround
+        uint32_t u32rtt = u32rxStart - u32queryTime;
+        if (slave->u16samples == 0)
         {
-            isSupported = 1;
-            break;
+            slave->u32srtt = u32rtt;
+            slave->u32rttvar = u32rtt / 2;
+        }
+        else
+        {
+            uint32_t u32err = (u32rtt > slave->u32srtt) ? u32rtt - slave->u32srtt : slave->u32srtt - u32rtt;
+            slave->u32rttvar = slave->u32rttvar - (slave->u32rttvar >> 2) + (u32err >> 2);
+            slave->u32srtt = slave->u32srtt - (slave->u32srtt >> 3) + (u32rtt >> 3);
         }
+        if (slave->u16samples < 0xFFFF) slave->u16samples++;
     }
-    if (!isSupported)
+    else if (slave->u16samples != 0)
     {
-        u16errCnt ++;
-        return EXC_FUNC_CODE;
+        // a miss may mean the slave got slower: back the deviation off
+        slave->u32rttvar = (slave->u32rttvar < u32ceiling) ? slave->u32rttvar * 2 + 1 : u32ceiling;
     }
-
-    uint16_t u16regs = 0;
-    uint8_t u8regs;
-    switch ( au8Buffer[ FUNC ] )
+    else
     {
-    case MB_FC_READ_COILS:
-    case MB_FC_READ_DISCRETE_INPUT:
-    case MB_FC_WRITE_MULTIPLE_COILS:
-        u16regs = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ]) / 16;
-        u16regs += word( au8Buffer[ NB_HI ], au8Buffer[ NB_LO ]) /16;
-        u8regs = (uint8_t) u16regs;
-        if (u8regs > u8regsize) return EXC_ADDR_RANGE;
-        break;
-    case MB_FC_WRITE_COIL:
-        u16regs = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ]) / 16;
-        u8regs = (uint8_t) u16regs;
-        if (u8regs > u8regsize) return EXC_ADDR_RANGE;
-        break;
-    case MB_FC_WRITE_REGISTER :
-        u16regs = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ]);
-        u8regs = (uint8_t) u16regs;
-        if (u8regs > u8regsize) return EXC_ADDR_RANGE;
-        break;
-    case MB_FC_READ_REGISTERS :
-    case MB_FC_READ_INPUT_REGISTER :
-    case MB_FC_WRITE_MULTIPLE_REGISTERS :
-        u16regs = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ]);
-        u16regs += word( au8Buffer[ NB_HI ], au8Buffer[ NB_LO ]);
-        u8regs = (uint8_t) u16regs;
-        if (u8regs > u8regsize) return EXC_ADDR_RANGE;
-        break;
+        // never answered: nothing to learn from, keep waiting the ceiling
+        slave->u32timeOut = u32ceiling;
+        return;
     }
-    return 0; // OK, no exception code thrown
+
+    uint32_t u32timeOut = slave->u32srtt + 4 * slave->u32rttvar + u32T35;
+    if (u32timeOut < u32floor) u32timeOut = u32floor;
+    if (u32timeOut > u32ceiling) u32timeOut = u32ceiling;
+    slave->u32timeOut = u32timeOut;
 }
 
-uint8_t Modbus::validateAnswer()
+void Modbus::updateQuarantine( modbus_slave_t *slave, boolean bAnswered )
 {
-    uint16_t u16MsgCRC =
-        ((au8Buffer[u8BufferSize - 2] << 8)
-         | au8Buffer[u8BufferSize - 1]); // combine the crc Low & High bytes
-    if ( calcCRC( u8BufferSize-2 ) != u16MsgCRC )
+    if (bAnswered)
     {
-        u16errCnt ++;
-        return NO_REPLY;
+        slave->u8fails = 0;
+        if (slave->u8backoff == 0) return;
+        slave->u8backoff = 0;
+        if (quarantineHandler != NULL) quarantineHandler( slave->u8id, false );
+        return;
     }
 
-    if ((au8Buffer[ FUNC ] & 0x80) != 0)
-    {
-        u16errCnt ++;
-        return ERR_EXCEPTION;
-    }
+    if (slave->u8fails < 0xFF) slave->u8fails++;
+    if (u8qFails == 0) return;
 
-    boolean isSupported = false;
-    for (uint8_t i = 0; i< sizeof( fctsupported ); i++)
+    if (slave->u8backoff == 0)
     {
-        if (fctsupported[i] == au8Buffer[FUNC])
-        {
-            isSupported = 1;
-            break;
-        }
+        if (slave->u8fails < u8qFails) return;
+        slave->u8backoff = 1;
+        if (quarantineHandler != NULL) quarantineHandler( slave->u8id, true );
     }
-    if (!isSupported)
+    else if (((uint32_t)u16probeMin << (slave->u8backoff - 1)) < u16probeMax)
     {
-        u16errCnt ++;
-        return EXC_FUNC_CODE;
+        // missed probe: double the interval up to u16probeMax
+        slave->u8backoff++;
     }
 
-    return 0; // OK, no exception code thrown
+    uint32_t u32interval = (uint32_t)u16probeMin << (slave->u8backoff - 1);
+    if (u32interval > u16probeMax) u32interval = u16probeMax;
+    slave->u32probe = getMillis() + u32interval;
 }
 
-void Modbus::buildException( uint8_t u8exception )
+void Modbus::setSeqLock( modbus_seqlock_t *lock )
 {
-    uint8_t u8func = au8Buffer[ FUNC ];  // get the original FUNC code
+    this->pseqlock = lock;
+}
 
-    au8Buffer[ ID ]      = u8id;
-    au8Buffer[ FUNC ]    = u8func + 0x80;
-    au8Buffer[ 2 ]       = u8exception;
-    u8BufferSize         = EXCEPTION_SIZE;
+uint32_t Modbus::readBegin()
+{
+    return (pseqlock != NULL) ? ModbusSeq_readBegin( pseqlock ) : 0;
 }
 
-void Modbus::get_FC1()
+boolean Modbus::readRetry( uint32_t u32seq )
 {
-    uint8_t u8byte, i;
-    u8byte = 3;
-     for (i=0; i< au8Buffer[2]; i++) {
-        
-        if(i%2)
-        {
-            au16regs[i/2]= word(au8Buffer[i+u8byte], lowByte(au16regs[i/2]));
-        }
-        else
+    return (pseqlock != NULL) && ModbusSeq_readRetry( pseqlock, u32seq );
+}
+
+void Modbus::writeBegin()
+{
+    if (pseqlock != NULL) ModbusSeq_writeBegin( pseqlock );
+}
+
+void Modbus::writeEnd()
+{
+    if (pseqlock != NULL) ModbusSeq_writeEnd( pseqlock );
+}
+
+void Modbus::setWriteHandler( modbus_write_t handler )
+{
+    this->writeHandler = handler;
+}
+
+void Modbus::setChangeList( modbus_range_t *ranges, uint8_t u8ranges )
+{
+    this->achanges = ranges;
+    this->u8changes = (ranges != NULL) ? u8ranges : 0;
+    this->u8changeHead = 0;
+    this->u8changeCnt = 0;
+    this->bChangeOverflow = false;
+}
+
+boolean Modbus::getChange( modbus_range_t *range )
+{
+    if (u8changeCnt == 0) return false;
+    *range = achanges[ u8changeHead ];
+    u8changeHead++;
+    if (u8changeHead >= u8changes) u8changeHead = 0;
+    u8changeCnt--;
+    return true;
+}
+
+boolean Modbus::getChangeOverflow()
+{
+    boolean bOverflow = bChangeOverflow;
+    bChangeOverflow = false;
+    return bOverflow;
+}
+
+void Modbus::noteWrite( uint8_t u8bank, uint16_t u16add, uint16_t u16count )
+{
+    modbus_range_t range = { u8bank, u16add, u16count };
+    invalidateCache( u8bank, u16add, u16count );
+    if (writeHandler != NULL) writeHandler( &range );
+    if (u8changes == 0) return;
+
+    // fold into the newest range when they touch, so a master sweeping
+    // a block costs one entry
+    if (u8changeCnt != 0)
+    {
+        modbus_range_t *last = &achanges[ (u8changeHead + u8changeCnt - 1) % u8changes ];
+        uint32_t u32first = (last->u16add < u16add) ? last->u16add : u16add;
+        uint32_t u32end = (uint32_t)last->u16add + last->u16count;
+        if ((uint32_t)u16add + u16count > u32end) u32end = (uint32_t)u16add + u16count;
+        if (last->u8bank == u8bank && u32end - u32first <= 0xFFFF &&
+            u16add <= (uint32_t)last->u16add + last->u16count &&
+            last->u16add <= (uint32_t)u16add + u16count)
         {
-           
-            au16regs[i/2]= word(highByte(au16regs[i/2]), au8Buffer[i+u8byte]); 
+            last->u16add = (uint16_t) u32first;
+            last->u16count = (uint16_t) (u32end - u32first);
+            return;
         }
-        
-     }
+    }
+
+    if (u8changeCnt >= u8changes)
+    {
+        bChangeOverflow = true;
+        return;
+    }
+    achanges[ (u8changeHead + u8changeCnt) % u8changes ] = range;
+    u8changeCnt++;
 }
 
-void Modbus::get_FC3()
+void Modbus::setResponseCache( modbus_cache_t *entries, uint8_t u8entries )
 {
-    uint8_t u8byte, i;
-    u8byte = 3;
+    this->acache = entries;
+    this->u8cache = (entries != NULL) ? u8entries : 0;
+    this->u8cacheNext = 0;
+    for (uint8_t i = 0; i < this->u8cache; i++) entries[ i ].u16length = 0;
+}
 
-    for (i=0; i< au8Buffer[ 2 ] /2; i++)
+modbus_cache_t *Modbus::findCache( uint8_t u8fct, uint16_t u16add, uint16_t u16count )
+{
+    for (uint8_t i = 0; i < u8cache; i++)
     {
-        au16regs[ i ] = word(
-                            au8Buffer[ u8byte ],
-                            au8Buffer[ u8byte +1 ]);
-        u8byte += 2;
+        modbus_cache_t *entry = &acache[ i ];
+        if (entry->u16length == 0 || entry->u8fct != u8fct ||
+            entry->u16add != u16add || entry->u16count != u16count) continue;
+
+        // producers behind a sequence lock do not invalidate: compare instead
+        if (pseqlock != NULL && entry->u32seq != ModbusSeq_readBegin( pseqlock ))
+        {
+            entry->u16length = 0;
+            return NULL;
+        }
+        return entry;
     }
+    return NULL;
 }
 
-int8_t Modbus::process_FC1( uint16_t *regs, uint8_t /*u8size*/ )
+void Modbus::storeCache( uint8_t u8fct, uint16_t u16add, uint16_t u16count, uint16_t u16length )
 {
-    uint8_t u8currentRegister, u8currentBit, u8bytesno, u8bitsno;
-    uint8_t u8CopyBufferSize;
-    uint16_t u16currentCoil, u16coil;
-
-    uint16_t u16StartCoil = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ] );
-    uint16_t u16Coilno = word( au8Buffer[ NB_HI ], au8Buffer[ NB_LO ] );
+    // take an empty entry, or recycle one round-robin
+    modbus_cache_t *entry = NULL;
+    for (uint8_t i = 0; i < u8cache; i++)
+    {
+        if (acache[ i ].u16length == 0)
+        {
+            entry = &acache[ i ];
+            break;
+        }
+    }
+    if (entry == NULL)
+    {
+        entry = &acache[ u8cacheNext ];
+        u8cacheNext++;
+        if (u8cacheNext >= u8cache) u8cacheNext = 0;
+    }
 
-    u8bytesno = (uint8_t) (u16Coilno / 8);
-    if (u16Coilno % 8 != 0) u8bytesno ++;
-    au8Buffer[ ADD_HI ]  = u8bytesno;
-    u8BufferSize         = ADD_LO;
-    au8Buffer[ u8BufferSize + u8bytesno - 1 ] = 0;
+    entry->u16length = 0;
+    if (u16length > entry->u16size) return;
+    memcpy( entry->au8frame, au8Buffer, u16length );
+    entry->u8fct = u8fct;
+    entry->u16add = u16add;
+    entry->u16count = u16count;
+    entry->u32seq = u32readSeq;
+    entry->u16length = u16length;
+}
 
-    u8bitsno = 0;
+void Modbus::invalidateCache( uint8_t u8bank, uint16_t u16add, uint16_t u16count )
+{
+    // compare word spans: coils share words of the aliased array with
+    // registers unless the slave serves separate banks
+    uint32_t u32first = u16add, u32end = (uint32_t)u16add + u16count;
+    if (u8bank == BANK_COILS || u8bank == BANK_DISCRETE)
+    {
+        u32first >>= 4;
+        u32end = (u32end + 15) >> 4;
+    }
 
-    for (u16currentCoil = 0; u16currentCoil < u16Coilno; u16currentCoil++)
+    for (uint8_t i = 0; i < u8cache; i++)
     {
-        u16coil = u16StartCoil + u16currentCoil;
-        u8currentRegister = (uint8_t) (u16coil / 16);
-        u8currentBit = (uint8_t) (u16coil % 16);
+        modbus_cache_t *entry = &acache[ i ];
+        if (entry->u16length == 0) continue;
 
-        bitWrite(
-            au8Buffer[ u8BufferSize ],
-            u8bitsno,
-            bitRead( regs[ u8currentRegister ], u8currentBit ) );
-        u8bitsno ++;
+        uint8_t u8entryBank = ModbusCore_bank( entry->u8fct );
+        if (pbanks != NULL && u8entryBank != u8bank) continue;
 
-        if (u8bitsno > 7)
+        uint32_t u32entryFirst = entry->u16add, u32entryEnd = (uint32_t)entry->u16add + entry->u16count;
+        if (u8entryBank == BANK_COILS || u8entryBank == BANK_DISCRETE)
         {
-            u8bitsno = 0;
-            u8BufferSize++;
+            u32entryFirst >>= 4;
+            u32entryEnd = (u32entryEnd + 15) >> 4;
         }
+        if (u32first < u32entryEnd && u32entryFirst < u32end) entry->u16length = 0;
     }
+}
 
-    if (u16Coilno % 8 != 0) u8BufferSize ++;
-    u8CopyBufferSize = u8BufferSize +2;
-    sendTxBuffer();
-    return u8CopyBufferSize;
+void Modbus::selectBank( uint8_t u8bank )
+{
+    switch (u8bank)
+    {
+    case BANK_COILS:
+        au16regs = pbanks->au16coils;
+        u32bitsize = pbanks->u16coils;
+        break;
+    case BANK_DISCRETE:
+        au16regs = pbanks->au16discrete;
+        u32bitsize = pbanks->u16discrete;
+        break;
+    case BANK_INPUT:
+        au16regs = pbanks->au16input;
+        u16regsize = pbanks->u16input;
+        break;
+    default:
+        au16regs = pbanks->au16holding;
+        u16regsize = pbanks->u16holding;
+        break;
+    }
 }
 
-int8_t Modbus::process_FC3( uint16_t *regs, uint8_t /*u8size*/ )
+boolean Modbus::hasRegs( uint16_t u16add, uint32_t u32count )
 {
+    if (pregmap != NULL) return pregmap->isMapped( u16add, u32count );
+    return ((uint32_t)u16add + u32count <= u16regsize);
+}
 
-    uint8_t u8StartAdd = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ] );
-    uint8_t u8regsno = word( au8Buffer[ NB_HI ], au8Buffer[ NB_LO ] );
-    uint8_t u8CopyBufferSize;
-    uint8_t i;
+boolean Modbus::hasBits( uint16_t u16add, uint16_t u16count )
+{
+    if (pregmap == NULL) return ((uint32_t)u16add + u16count <= u32bitsize);
+    uint16_t u16first = u16add >> 4;
+    return hasRegs( u16first, ((uint32_t)u16add + u16count + 15) / 16 - u16first );
+}
 
-    au8Buffer[ 2 ]       = u8regsno * 2;
-    u8BufferSize         = 3;
+uint16_t *Modbus::getReg( uint16_t u16add )
+{
+    if (pregmap != NULL) return pregmap->find( u16add );
+    return &au16regs[ u16add ];
+}
 
-    for (i = u8StartAdd; i < u8StartAdd + u8regsno; i++)
+void Modbus::packRegs( uint8_t *au8dst, uint16_t u16add, uint16_t u16count )
+{
+    if (pregmap == NULL)
     {
-        au8Buffer[ u8BufferSize ] = highByte(regs[i]);
-        u8BufferSize++;
-        au8Buffer[ u8BufferSize ] = lowByte(regs[i]);
-        u8BufferSize++;
+        ModbusRegs_pack( au8dst, &au16regs[ u16add ], u16count );
+        return;
     }
-    u8CopyBufferSize = u8BufferSize +2;
-    sendTxBuffer();
+    // one kernel call per mapped run
+    while (u16count > 0)
+    {
+        uint16_t u16run;
+        uint16_t *regs = pregmap->run( u16add, &u16run );
+        if (u16run > u16count) u16run = u16count;
+        ModbusRegs_pack( au8dst, regs, u16run );
+        au8dst += u16run * 2;
+        u16add += u16run;
+        u16count -= u16run;
+    }
+}
 
-    return u8CopyBufferSize;
+void Modbus::unpackRegs( uint16_t u16add, const uint8_t *au8src, uint16_t u16count )
+{
+    if (pregmap == NULL)
+    {
+        ModbusRegs_unpack( &au16regs[ u16add ], au8src, u16count );
+        return;
+    }
+    while (u16count > 0)
+    {
+        uint16_t u16run;
+        uint16_t *regs = pregmap->run( u16add, &u16run );
+        if (u16run > u16count) u16run = u16count;
+        ModbusRegs_unpack( regs, au8src, u16run );
+        au8src += u16run * 2;
+        u16add += u16run;
+        u16count -= u16run;
+    }
 }
 
-int8_t Modbus::process_FC5( uint16_t *regs, uint8_t /*u8size*/ )
+void Modbus::packBits( uint8_t *au8dst, uint16_t u16add, uint16_t u16count )
 {
-    uint8_t u8currentRegister, u8currentBit;
-    uint8_t u8CopyBufferSize;
-    uint16_t u16coil = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ] );
-    u8currentRegister = (uint8_t) (u16coil / 16);
-    u8currentBit = (uint8_t) (u16coil % 16);
+    if (pregmap == NULL)
+    {
+        ModbusBits_pack( au8dst, au16regs, u16add, u16count );
+        return;
+    }
+    // mapped words need not be adjacent: gather 16 coils at a time into a
+    // two-word window so that every step emits whole bytes
+    uint16_t u16word = u16add >> 4;
+    uint8_t u8shift = u16add & 0x0F;
+    uint16_t au16window[ 2 ] = { 0, 0 };
+    while (u16count > 0)
+    {
+        uint16_t u16step = (u16count > 16) ? 16 : u16count;
+        au16window[ 0 ] = *pregmap->find( u16word );
+        if (u8shift + u16step > 16) au16window[ 1 ] = *pregmap->find( u16word + 1 );
+        ModbusBits_pack( au8dst, au16window, u8shift, u16step );
+        au8dst += 2;
+        u16word++;
+        u16count -= u16step;
+    }
+}
 
-    bitWrite(
-        regs[ u8currentRegister ],
-        u8currentBit,
-        au8Buffer[ NB_HI ] == 0xff );
+void Modbus::unpackBits( uint16_t u16add, const uint8_t *au8src, uint16_t u16count )
+{
+    if (pregmap == NULL)
+    {
+        ModbusBits_unpack( au16regs, u16add, au8src, u16count );
+        return;
+    }
+    uint16_t u16word = u16add >> 4;
+    uint8_t u8shift = u16add & 0x0F;
+    uint16_t au16window[ 2 ] = { 0, 0 };
+    while (u16count > 0)
+    {
+        uint16_t u16step = (u16count > 16) ? 16 : u16count;
+        uint16_t *reg0 = pregmap->find( u16word );
+        uint16_t *reg1 = (u8shift + u16step > 16) ? pregmap->find( u16word + 1 ) : NULL;
+        au16window[ 0 ] = *reg0;
+        if (reg1 != NULL) au16window[ 1 ] = *reg1;
+        ModbusBits_unpack( au16window, u8shift, au8src, u16step );
+        *reg0 = au16window[ 0 ];
+        if (reg1 != NULL) *reg1 = au16window[ 1 ];
+        au8src += 2;
+        u16word++;
+        u16count -= u16step;
+    }
+}
 
+void Modbus::buildException( uint8_t u8exception )
+{
+    u16BufferSize = ModbusCore_exception( au8Buffer, u8id, u8exception );
+}
 
-    u8BufferSize = 6;
-    u8CopyBufferSize = u8BufferSize +2;
+int16_t Modbus::process()
+{
+    u16BufferSize = ModbusCore_process( &coreAccess, this, au8Buffer );
+    int16_t i16answer = u16BufferSize + CHECKSUM_SIZE;
     sendTxBuffer();
-
-    return u8CopyBufferSize;
+    return i16answer;
 }
 
-int8_t Modbus::process_FC6( uint16_t *regs, uint8_t /*u8size*/ )
+/* _____SLAVE DATA SEEN BY THE PROTOCOL CORE_________________________________ */
+
+const modbus_access_t Modbus::coreAccess =
 {
+    &Modbus::accessExists,
+    &Modbus::accessRead,
+    &Modbus::accessWrite,
+    &Modbus::accessMask
+};
 
-    uint8_t u8add = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ] );
-    uint8_t u8CopyBufferSize;
-    uint16_t u16val = word( au8Buffer[ NB_HI ], au8Buffer[ NB_LO ] );
+bool Modbus::accessExists( void *ctx, uint8_t u8bank, uint16_t u16add, uint32_t u32count )
+{
+    Modbus *self = (Modbus *) ctx;
+    if (self->pbanks != NULL) self->selectBank( u8bank );
+    if (u8bank == BANK_COILS || u8bank == BANK_DISCRETE) return self->hasBits( u16add, u32count );
+    return self->hasRegs( u16add, u32count );
+}
 
-    regs[ u8add ] = u16val;
+void Modbus::accessRead( void *ctx, uint8_t u8bank, uint8_t *au8dst, uint16_t u16add, uint16_t u16count )
+{
+    Modbus *self = (Modbus *) ctx;
+    if (self->pbanks != NULL) self->selectBank( u8bank );
 
-    u8BufferSize         = RESPONSE_SIZE;
+    uint32_t u32seq;
+    do
+    {
+        u32seq = self->readBegin();
+        if (u8bank == BANK_COILS || u8bank == BANK_DISCRETE)
+            self->packBits( au8dst, u16add, u16count );
+        else
+            self->packRegs( au8dst, u16add, u16count );
+    }
+    while (self->readRetry( u32seq ));
+    self->u32readSeq = u32seq;
+}
 
-    u8CopyBufferSize = u8BufferSize +2;
-    sendTxBuffer();
+void Modbus::accessWrite( void *ctx, uint8_t u8bank, uint16_t u16add, const uint8_t *au8src, uint16_t u16count )
+{
+    Modbus *self = (Modbus *) ctx;
+    if (self->pbanks != NULL) self->selectBank( u8bank );
+
+    self->writeBegin();
+    if (u8bank == BANK_COILS)
+        self->unpackBits( u16add, au8src, u16count );
+    else
+        self->unpackRegs( u16add, au8src, u16count );
+    self->writeEnd();
+    self->noteWrite( u8bank, u16add, u16count );
+}
 
-    return u8CopyBufferSize;
+void Modbus::accessMask( void *ctx, uint16_t u16add, uint16_t u16and, uint16_t u16or )
+{
+    Modbus *self = (Modbus *) ctx;
+    if (self->pbanks != NULL) self->selectBank( BANK_HOLDING );
+
+    // one read-modify-write of the image: no other request can interleave
+    uint16_t *reg = self->getReg( u16add );
+    self->writeBegin();
+    *reg = (*reg & u16and) | (u16or & ~u16and);
+    self->writeEnd();
+    self->noteWrite( BANK_HOLDING, u16add, 1 );
 }
 
-int8_t Modbus::process_FC15( uint16_t *regs, uint8_t /*u8size*/ )
+ModbusScheduler::ModbusScheduler(Modbus &master, modbus_poll_t *polls, uint8_t u8polls)
 {
-    uint8_t u8currentRegister, u8currentBit, u8frameByte, u8bitsno;
-    uint8_t u8CopyBufferSize;
-    uint16_t u16currentCoil, u16coil;
-    boolean bTemp;
+    this->master = &master;
+    this->apoll = polls;
+    this->u8polls = u8polls;
+    this->u8current = SCHED_NONE;
+    this->u8next = 0;
+    this->u32cycleStart = master.getMicros();
+    this->u32cycleTime = 0;
+    this->u16cycleCnt = 0;
+    this->bCycleBusy = false;
+}
 
-    uint16_t u16StartCoil = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ] );
-    uint16_t u16Coilno = word( au8Buffer[ NB_HI ], au8Buffer[ NB_LO ] );
+uint32_t ModbusScheduler::getCycleTime()
+{
+    return u32cycleTime;
+}
 
-    u8bitsno = 0;
-    u8frameByte = 7;
-    for (u16currentCoil = 0; u16currentCoil < u16Coilno; u16currentCoil++)
-    {
+uint16_t ModbusScheduler::getCycleCnt()
+{
+    return u16cycleCnt;
+}
 
-        u16coil = u16StartCoil + u16currentCoil;
-        u8currentRegister = (uint8_t) (u16coil / 16);
-        u8currentBit = (uint8_t) (u16coil % 16);
+int16_t ModbusScheduler::run()
+{
+    int16_t i16done = -1;
 
-        bTemp = bitRead(
-                    au8Buffer[ u8frameByte ],
-                    u8bitsno );
+    if (u8current != SCHED_NONE)
+    {
+        master->poll();
+        if (master->getState() != COM_IDLE) return -1;
 
-        bitWrite(
-            regs[ u8currentRegister ],
-            u8currentBit,
-            bTemp );
+        apoll[ u8current ].u8lastError = master->getLastError();
+        if (apoll[ u8current ].u8lastError == 0) apoll[ u8current ].u16okCnt++;
+        i16done = u8current;
+        u8current = SCHED_NONE;
+    }
 
-        u8bitsno ++;
+    // keep the bus busy: issue the next due telegram once T3.5 has passed
+    if (!master->isReady()) return i16done;
 
-        if (u8bitsno > 7)
+    uint32_t u32now = master->getMillis();
+    for (uint8_t i = 0; i < u8polls; i++)
+    {
+        if (u8next == 0)
         {
-            u8bitsno = 0;
-            u8frameByte++;
+            // a new pass over the poll list starts here
+            uint32_t u32us = master->getMicros();
+            if (bCycleBusy)
+            {
+                u32cycleTime = u32us - u32cycleStart;
+                u16cycleCnt++;
+            }
+            u32cycleStart = u32us;
+            bCycleBusy = false;
         }
+
+        uint8_t u8idx = u8next;
+        u8next++;
+        if (u8next >= u8polls) u8next = 0;
+
+        modbus_poll_t *poll = &apoll[ u8idx ];
+        if (poll->u32period != 0 &&
+            (unsigned long)(u32now - poll->u32last) < (unsigned long)poll->u32period) continue;
+
+        if (master->query( poll->telegram ) != 0) continue;
+        poll->u32last = u32now;
+        u8current = u8idx;
+        bCycleBusy = true;
+        break;
     }
+    return i16done;
+}
 
-    u8BufferSize         = 6;
-    u8CopyBufferSize = u8BufferSize +2;
-    sendTxBuffer();
-    return u8CopyBufferSize;
+ModbusRegisterMap::ModbusRegisterMap(modbus_reggroup_t *groups, uint8_t u8groups)
+{
+    this->agroups = groups;
+    this->u8groups = u8groups;
+    this->u8used = 0;
+    memset( this->au8group, REGMAP_NONE, sizeof( this->au8group ) );
 }
 
-int8_t Modbus::process_FC16( uint16_t *regs, uint8_t /*u8size*/ )
+boolean ModbusRegisterMap::map( uint16_t u16start, uint16_t *regs, uint16_t u16count )
 {
-    uint8_t u8StartAdd = au8Buffer[ ADD_HI ] << 8 | au8Buffer[ ADD_LO ];
-    uint8_t u8regsno = au8Buffer[ NB_HI ] << 8 | au8Buffer[ NB_LO ];
-    uint8_t u8CopyBufferSize;
-    uint8_t i;
-    uint16_t temp;
+    if (u16count == 0 || (uint32_t)u16start + u16count > 0x10000UL) return false;
 
-    au8Buffer[ NB_HI ]   = 0;
-    au8Buffer[ NB_LO ]   = u8regsno;
-    u8BufferSize         = RESPONSE_SIZE;
+    // check every page and the groups still needed before touching anything
+    uint8_t u8newGroups = 0;
+    uint8_t u8lastGroup = REGMAP_NONE;
+    for (uint32_t u32page = u16start >> REGMAP_PAGE_BITS;
+         u32page <= ((uint32_t)u16start + u16count - 1) >> REGMAP_PAGE_BITS; u32page++)
+    {
+        uint8_t u8group = u32page / REGMAP_GROUP_PAGES;
+        if (au8group[ u8group ] == REGMAP_NONE)
+        {
+            if (u8group != u8lastGroup) u8newGroups++;
+            u8lastGroup = u8group;
+            continue;
+        }
+        if (agroups[ au8group[ u8group ] ].apage[ u32page % REGMAP_GROUP_PAGES ].au16regs != NULL) return false;
+    }
+    if (u8used + u8newGroups > u8groups) return false;
 
-    for (i = 0; i < u8regsno; i++)
+    while (u16count > 0)
     {
-        temp = word(
-                   au8Buffer[ (BYTE_CNT + 1) + i * 2 ],
-                   au8Buffer[ (BYTE_CNT + 2) + i * 2 ]);
+        uint16_t u16page = u16start >> REGMAP_PAGE_BITS;
+        uint8_t u8group = u16page / REGMAP_GROUP_PAGES;
+        if (au8group[ u8group ] == REGMAP_NONE)
+        {
+            memset( &agroups[ u8used ], 0, sizeof( modbus_reggroup_t ) );
+            au8group[ u8group ] = u8used++;
+        }
 
-        regs[ u8StartAdd + i ] = temp;
+        modbus_regpage_t *page = &agroups[ au8group[ u8group ] ].apage[ u16page % REGMAP_GROUP_PAGES ];
+        uint8_t u8first = u16start & (REGMAP_PAGE_SIZE - 1);
+        uint16_t u16run = REGMAP_PAGE_SIZE - u8first;
+        if (u16run > u16count) u16run = u16count;
+        page->au16regs = regs;
+        page->u8first = u8first;
+        page->u8count = (uint8_t) u16run;
+
+        regs += u16run;
+        u16start += u16run;
+        u16count -= u16run;
     }
-    u8CopyBufferSize = u8BufferSize +2;
-    sendTxBuffer();
+    return true;
+}
 
-    return u8CopyBufferSize;
+uint16_t *ModbusRegisterMap::run( uint16_t u16add, uint16_t *pu16count )
+{
+    *pu16count = 0;
+    uint8_t u8group = au8group[ u16add >> (REGMAP_PAGE_BITS + REGMAP_GROUP_BITS) ];
+    if (u8group == REGMAP_NONE) return NULL;
+
+    modbus_regpage_t *page = &agroups[ u8group ].apage[ (u16add >> REGMAP_PAGE_BITS) % REGMAP_GROUP_PAGES ];
+    uint8_t u8offset = (u16add & (REGMAP_PAGE_SIZE - 1)) - page->u8first;
+    if (page->au16regs == NULL || u8offset >= page->u8count) return NULL;
+
+    *pu16count = page->u8count - u8offset;
+    return page->au16regs + u8offset;
+}
+
+uint16_t *ModbusRegisterMap::find( uint16_t u16add )
+{
+    uint16_t u16run;
+    return run( u16add, &u16run );
+}
+
+boolean ModbusRegisterMap::isMapped( uint16_t u16add, uint32_t u32count )
+{
+    if ((uint32_t)u16add + u32count > 0x10000UL) return false;
+    while (u32count > 0)
+    {
+        uint16_t u16run;
+        if (run( u16add, &u16run ) == NULL) return false;
+        if (u16run >= u32count) return true;
+        u16add += u16run;
+        u32count -= u16run;
+    }
+    return true;
 }
@@ -3,119 +3,231 @@
 
 #include <inttypes.h>
 #include "Arduino.h"
+#include "ModbusSeq.h"
+#include "ModbusCore.h"
 
 typedef struct
 {
-    uint8_t u8id;          /*!< Slave address between 1 and 247. 0 means broadcast */
-    uint8_t u8fct;         /*!< Function code: 1, 2, 3, 4, 5, 6, 15 or 16 */
-    uint16_t u16RegAdd;    /*!< Address of the first register to access at slave/s */
-    uint16_t u16CoilsNo;   /*!< Number of coils or registers to access */
-    uint16_t *au16reg;     /*!< Pointer to memory image in master */
+    modbus_t telegram;     /*!< Query issued by the scheduler */
+    uint32_t u32period;    /*!< Minimum time between two issues in ms, 0 = every cycle */
+    uint32_t u32last;      /*!< millis() of the last issue, managed by the scheduler */
+    uint8_t u8lastError;   /*!< Outcome of the last transaction: 0 = answered, NO_REPLY or an ERR_LIST code */
+    uint16_t u16okCnt;     /*!< Number of answered transactions */
 }
-modbus_t;
+modbus_poll_t;
 
-enum
+typedef struct
 {
-    RESPONSE_SIZE = 6,
-    EXCEPTION_SIZE = 3,
-    CHECKSUM_SIZE = 2
-};
+    uint8_t u8id;          /*!< Slave address, 0 = free entry */
+    uint16_t u16samples;   /*!< Number of answers measured */
+    uint32_t u32srtt;      /*!< Smoothed answer latency in us */
+    uint32_t u32rttvar;    /*!< Smoothed latency deviation in us */
+    uint32_t u32timeOut;   /*!< Timeout derived for this slave in us */
+    uint8_t u8fails;       /*!< Consecutive transactions without an answer */
+    uint8_t u8backoff;     /*!< 0 = healthy, else quarantined with probe interval doubled u8backoff-1 times */
+    uint32_t u32probe;     /*!< millis() from which the next probe is allowed while quarantined */
+}
+modbus_slave_t;
 
-enum MESSAGE
+#define REGMAP_PAGE_BITS   6    //!< a page covers 64 addresses
+#define REGMAP_PAGE_SIZE   (1 << REGMAP_PAGE_BITS)
+#define REGMAP_GROUP_BITS  5
+#define REGMAP_GROUP_PAGES (1 << REGMAP_GROUP_BITS) //!< pages per group: 2048 addresses
+#define REGMAP_GROUPS      32   //!< groups covering the 65536 address space
+#define REGMAP_NONE        0xFF //!< group not allocated
+
+typedef struct
 {
-    ID                             = 0, //!< ID field
-    FUNC, //!< Function code position
-    ADD_HI, //!< Address high byte
-    ADD_LO, //!< Address low byte
-    NB_HI, //!< Number of coils or registers high byte
-    NB_LO, //!< Number of coils or registers low byte
-    BYTE_CNT  //!< byte counter
-};
+    uint16_t *au16regs;    /*!< Register holding the first mapped address of the page, NULL = unmapped */
+    uint8_t u8first;       /*!< Offset of that address inside the page */
+    uint8_t u8count;       /*!< Number of consecutive mapped addresses */
+}
+modbus_regpage_t;
 
-enum MB_FC
+typedef struct
 {
-    MB_FC_NONE                     = 0,   /*!< null operator */
-    MB_FC_READ_COILS               = 1,	/*!< FCT=1 -> read coils or digital outputs */
-    MB_FC_READ_DISCRETE_INPUT      = 2,	/*!< FCT=2 -> read digital inputs */
-    MB_FC_READ_REGISTERS           = 3,	/*!< FCT=3 -> read registers or analog outputs */
-    MB_FC_READ_INPUT_REGISTER      = 4,	/*!< FCT=4 -> read analog inputs */
-    MB_FC_WRITE_COIL               = 5,	/*!< FCT=5 -> write single coil or output */
-    MB_FC_WRITE_REGISTER           = 6,	/*!< FCT=6 -> write single register */
-    MB_FC_WRITE_MULTIPLE_COILS     = 15,	/*!< FCT=15 -> write multiple coils or outputs */
-    MB_FC_WRITE_MULTIPLE_REGISTERS = 16	/*!< FCT=16 -> write multiple registers */
-};
+    modbus_regpage_t apage[ REGMAP_GROUP_PAGES ];
+}
+modbus_reggroup_t;
 
-enum COM_STATES
+/**
+ * Slave data model with one bank per object type. Coils and discrete inputs
+ * are bitsets: bit n%16 of word n/16. Sizes count coils, inputs or
+ * registers, so every bank is range checked on its own.
+ */
+typedef struct
 {
-    COM_IDLE                     = 0,
-    COM_WAITING                  = 1
+    uint16_t *au16coils;    /*!< Coils, read/write bits */
+    uint16_t u16coils;
+    uint16_t *au16discrete; /*!< Discrete inputs, read-only bits */
+    uint16_t u16discrete;
+    uint16_t *au16input;    /*!< Input registers, read-only */
+    uint16_t u16input;
+    uint16_t *au16holding;  /*!< Holding registers, read/write */
+    uint16_t u16holding;
+}
+modbus_banks_t;
 
-};
+typedef struct
+{
+    uint8_t u8bank;        /*!< BANK_COILS or BANK_HOLDING */
+    uint16_t u16add;       /*!< First coil or register written */
+    uint16_t u16count;     /*!< Number of coils or registers written */
+}
+modbus_range_t;
 
-enum ERR_LIST
+/**
+ * Serialized slave answer to one read request, CRC included. The frame
+ * storage belongs to the caller; 255 bytes hold any FC1-FC4 answer, a
+ * smaller u16size simply leaves longer answers uncached.
+ */
+typedef struct
 {
-    ERR_NOT_MASTER                = -1,
-    ERR_POLLING                   = -2,
-    ERR_BUFF_OVERFLOW             = -3,
-    ERR_BAD_CRC                   = -4,
-    ERR_EXCEPTION                 = -5
-};
+    uint8_t *au8frame;     /*!< Caller storage for the answer */
+    uint16_t u16size;      /*!< Capacity of au8frame */
+    uint16_t u16length;    /*!< Cached frame length, 0 = empty */
+    uint8_t u8fct;         /*!< Key: function code */
+    uint16_t u16add;       /*!< Key: first coil or register */
+    uint16_t u16count;     /*!< Key: number of coils or registers */
+    uint32_t u32seq;       /*!< Sequence lock value the answer was read under */
+}
+modbus_cache_t;
 
-enum
+typedef void (*modbus_write_t)( const modbus_range_t *range ); //!< called after a master wrote slave data
+
+typedef void (*modbus_quarantine_t)( uint8_t u8id, boolean bQuarantined ); //!< called on quarantine transitions
+typedef void (*modbus_txdone_t)( uint16_t u16length ); //!< called once an asynchronous frame is on the line
+typedef uint32_t (*modbus_clock_t)( void ); //!< free-running time source in us, wraps at 2^32
+
+/**
+ * Slave handler for a user function code. au8frame holds the request from
+ * the ID byte on, u16length bytes without CRC; the handler validates it
+ * and writes its answer in place (at most MAX_BUFFER - 2 bytes).
+ * Returns the answer length, 0 for no answer or -EXC_xxx for an exception;
+ * a longer answer is replaced by an EXC_EXECUTE exception.
+ */
+typedef int16_t (*modbus_handler_t)( uint8_t *au8frame, uint16_t u16length, uint16_t *regs, uint16_t u16size );
+
+enum COM_STATES
 {
-    NO_REPLY = 255,
-    EXC_FUNC_CODE = 1,
-    EXC_ADDR_RANGE = 2,
-    EXC_REGS_QUANT = 3,
-    EXC_EXECUTE = 4
+    COM_IDLE                     = 0,
+    COM_WAITING                  = 1,
+    COM_SENDING                  = 2  //!< asynchronous TX: frame still leaving the UART
+
 };
 
-const unsigned char fctsupported[] =
+#define  MAX_BUFFER  256	//!< maximum size for the communication buffer in bytes (full RTU ADU)
+#define MAX_USER_FCT  4  //!< function codes with a user handler per instance
+
+/**
+ * Sparse map of the 16-bit register address space for the slave.
+ *
+ * Two-level radix: address bits 15..11 select a group, bits 10..6 a page,
+ * bits 5..0 the register. Groups come from caller storage and are only
+ * taken for the 2048-address blocks that hold a mapped range; registers
+ * stay in the caller's arrays. One page holds one contiguous run, so two
+ * ranges may not share a 64-address page.
+ */
+class ModbusRegisterMap
 {
-    MB_FC_READ_COILS,
-    MB_FC_READ_DISCRETE_INPUT,
-    MB_FC_READ_REGISTERS,
-    MB_FC_READ_INPUT_REGISTER,
-    MB_FC_WRITE_COIL,
-    MB_FC_WRITE_REGISTER,
-    MB_FC_WRITE_MULTIPLE_COILS,
-    MB_FC_WRITE_MULTIPLE_REGISTERS
-};
+private:
+    modbus_reggroup_t *agroups; //!< caller-owned group storage
+    uint8_t u8groups, u8used;
+    uint8_t au8group[ REGMAP_GROUPS ]; //!< index into agroups or REGMAP_NONE
 
-#define T35  5
-#define  MAX_BUFFER  64	//!< maximum size for the communication buffer in bytes
+public:
+    ModbusRegisterMap(modbus_reggroup_t *groups, uint8_t u8groups);
+
+    boolean map( uint16_t u16start, uint16_t *regs, uint16_t u16count ); //!<expose regs[0..count) at u16start
+    uint16_t *find( uint16_t u16add ); //!<register at u16add or NULL
+    uint16_t *run( uint16_t u16add, uint16_t *pu16count ); //!<register at u16add and the length of its run in the page
+    boolean isMapped( uint16_t u16add, uint32_t u32count ); //!<every address of the range is mapped
+};
 
 class Modbus
 {
 private:
+    static const modbus_access_t coreAccess; //!< slave data as seen by the protocol core
+
     Stream *port; //!< Pointer to Stream class object (Either HardwareSerial or SoftwareSerial)
     uint8_t u8id; //!< 0=master, 1..247=slave number
     uint8_t u8txenpin; //!< flow control pin: 0=USB or RS-232 mode, >1=RS-485 mode
     uint8_t u8state;
     uint8_t u8lastError;
     uint8_t au8Buffer[MAX_BUFFER];
-    uint8_t u8BufferSize;
-    uint8_t u8lastRec;
+    uint16_t u16BufferSize;
+    modbus_rx_t rx; //!< frame being received into au8Buffer
     uint16_t *au16regs;
     uint16_t u16InCnt, u16OutCnt, u16errCnt;
     uint16_t u16timeOut;
-    uint32_t u32time, u32timeOut, u32overTime;
-    uint8_t u8regsize;
+    uint32_t u32time, u32timeOut, u32overTime; //!< u32time: timestamp of the last byte on the line in us
+    uint32_t u32T35; //!< inter-frame silence in us
+    uint32_t u32char; //!< time of one 11-bit character in us
+    uint32_t u32txStart, u32txTime; //!< asynchronous TX: start and duration of the frame in us
+    uint16_t u16txLength;
+    boolean bAsyncTx;
+    modbus_txdone_t txHandler;
+    uint8_t au8userMap[ 32 ]; //!< bit per function code with a user handler
+    uint8_t au8userFct[ MAX_USER_FCT ];
+    modbus_handler_t auserHandler[ MAX_USER_FCT ];
+    uint32_t u32queryTime, u32rxStart; //!< end of the last query and first byte of its answer in us
+    uint16_t u16queryNo; //!< coils or registers the pending query reads into au16regs
+    uint32_t u32rxTimeOut; //!< first answer byte must arrive within this many us
+    modbus_slave_t *aslaves; //!< caller-owned per-slave statistics, NULL = fixed u16timeOut
+    modbus_slave_t *pslave; //!< statistics of the slave being queried
+    uint8_t u8slaves, u8slaveNext;
+    uint16_t u16toFloor, u16toCeiling; //!< adaptive timeout bounds in ms
+    uint8_t u8qFails; //!< consecutive misses before quarantine, 0 = never
+    uint16_t u16probeMin, u16probeMax; //!< probe back-off bounds in ms
+    modbus_quarantine_t quarantineHandler;
+    uint16_t u16regsize;
+    uint32_t u32bitsize; //!< coils addressable in au16regs
+    ModbusRegisterMap *pregmap; //!< slave register space, NULL = au16regs[0..u16regsize)
+    const modbus_banks_t *pbanks; //!< slave banks, NULL = one aliased array
+    modbus_seqlock_t *pseqlock; //!< guards slave data shared with other threads, NULL = none
+    modbus_write_t writeHandler;
+    modbus_range_t *achanges; //!< caller-owned ring of written ranges, NULL = not recorded
+    uint8_t u8changes, u8changeHead, u8changeCnt;
+    boolean bChangeOverflow;
+    modbus_cache_t *acache; //!< caller-owned answer cache, NULL = pack every answer
+    uint8_t u8cache, u8cacheNext;
+    const void *pcacheSource; //!< regs, map or banks the cached answers were packed from
+    uint16_t u16cacheSize;
+    uint32_t u32readSeq; //!< sequence lock value of the last packed answer
+    modbus_clock_t clockSource; //!< NULL = micros() and millis()
+    uint32_t u32clockUs, u32clockMs, u32clockRem; //!< milliseconds accumulated from clockSource
 
     void sendTxBuffer();
-    int8_t getRxBuffer();
-    uint16_t calcCRC(uint8_t u8length);
+    void transmit( const uint8_t *au8frame, uint16_t u16length );
+    boolean pollTx();
+    int16_t getRxBuffer();
     uint8_t validateAnswer();
     uint8_t validateRequest();
-    void get_FC1();
-    void get_FC3();
-    int8_t process_FC1( uint16_t *regs, uint8_t u8size );
-    int8_t process_FC3( uint16_t *regs, uint8_t u8size );
-    int8_t process_FC5( uint16_t *regs, uint8_t u8size );
-    int8_t process_FC6( uint16_t *regs, uint8_t u8size );
-    int8_t process_FC15( uint16_t *regs, uint8_t u8size );
-    int8_t process_FC16( uint16_t *regs, uint8_t u8size );
+    int16_t process();
+    static bool accessExists( void *ctx, uint8_t u8bank, uint16_t u16add, uint32_t u32count );
+    static void accessRead( void *ctx, uint8_t u8bank, uint8_t *au8dst, uint16_t u16add, uint16_t u16count );
+    static void accessWrite( void *ctx, uint8_t u8bank, uint16_t u16add, const uint8_t *au8src, uint16_t u16count );
+    static void accessMask( void *ctx, uint16_t u16add, uint16_t u16and, uint16_t u16or );
+    uint32_t readBegin();
+    boolean readRetry( uint32_t u32seq );
+    void writeBegin();
+    void writeEnd();
+    void noteWrite( uint8_t u8bank, uint16_t u16add, uint16_t u16count );
+    modbus_cache_t *findCache( uint8_t u8fct, uint16_t u16add, uint16_t u16count );
+    void storeCache( uint8_t u8fct, uint16_t u16add, uint16_t u16count, uint16_t u16length );
+    void selectBank( uint8_t u8bank );
+    boolean hasRegs( uint16_t u16add, uint32_t u32count );
+    boolean hasBits( uint16_t u16add, uint16_t u16count );
+    uint16_t *getReg( uint16_t u16add );
+    void packRegs( uint8_t *au8dst, uint16_t u16add, uint16_t u16count );
+    void unpackRegs( uint16_t u16add, const uint8_t *au8src, uint16_t u16count );
+    void packBits( uint8_t *au8dst, uint16_t u16add, uint16_t u16count );
+    void unpackBits( uint16_t u16add, const uint8_t *au8src, uint16_t u16count );
+    modbus_handler_t getHandler( uint8_t u8fct );
     void buildException( uint8_t u8exception ); // build exception message
+    modbus_slave_t *findSlave( uint8_t u8id );
+    void updateSlave( modbus_slave_t *slave, boolean bAnswered );
+    void updateQuarantine( modbus_slave_t *slave, boolean bAnswered );
 
 public:
     Modbus(uint8_t u8id, Stream& port, uint8_t u8txenpin =0);
@@ -123,10 +235,19 @@ public:
     void start();
     void setTimeOut( uint16_t u16timeOut); //!<write communication watch-dog timer
     uint16_t getTimeOut(); //!<get communication watch-dog timer value
+    void setAdaptiveTimeOut( modbus_slave_t *slaves, uint8_t u8slaves, uint16_t u16floor, uint16_t u16ceiling ); //!<per-slave timeouts in [floor, ceiling] ms
+    modbus_slave_t *getSlave( uint8_t u8id ); //!<statistics of one slave or NULL
+    boolean setQuarantine( uint8_t u8fails, uint16_t u16probeMin, uint16_t u16probeMax ); //!<quarantine after u8fails misses, probe every [min, max] ms; needs the setAdaptiveTimeOut() table, false without it
+    void setQuarantineHandler( modbus_quarantine_t handler ); //!<notify quarantine entries and exits
+    boolean isQuarantined( uint8_t u8id ); //!<slave is quarantined
+    modbus_slave_t *getQuarantined( uint8_t u8index ); //!<u8index-th quarantined slave or NULL
     boolean getTimeOutState(); //!<get communication watch-dog timer state
+    boolean isReady(); //!<master is idle and T3.5 has passed since the last frame
     int8_t query( modbus_t telegram ); //!<only for master
-    int8_t poll(); //!<cyclic poll for master
-    int8_t poll( uint16_t *regs, uint8_t u8size ); //!<cyclic poll for slave
+    int16_t poll(); //!<cyclic poll for master
+    int16_t poll( uint16_t *regs, uint16_t u16size ); //!<cyclic poll for slave
+    int16_t poll( ModbusRegisterMap &map ); //!<cyclic poll for slave over a sparse register map
+    int16_t poll( const modbus_banks_t &banks ); //!<cyclic poll for slave over separate typed banks
     uint16_t getInCnt(); //!<number of incoming messages
     uint16_t getOutCnt(); //!<number of outcoming messages
     uint16_t getErrCnt(); //!<error counter
@@ -135,6 +256,20 @@ public:
     uint8_t getLastError(); //!<get last error message
     void setID( uint8_t u8id ); //!<write new ID for the slave
     void setTxendPinOverTime( uint32_t u32overTime );
+    void setBaudRate( uint32_t u32speed ); //!<derive T3.5 from the line speed
+    void setAsyncTx( boolean bAsync ); //!<return from query() and poll() while the frame is still sent
+    void setTxHandler( modbus_txdone_t handler ); //!<notify the end of an asynchronous frame
+    void setClock( modbus_clock_t clock ); //!<take time from clock instead of micros(), NULL restores it
+    uint32_t getMicros(); //!<current time of this instance in us
+    uint32_t getMillis(); //!<current time of this instance in ms
+    boolean setHandler( uint8_t u8fct, modbus_handler_t handler ); //!<serve a function code from user code, NULL removes it
+    void setSeqLock( modbus_seqlock_t *lock ); //!<read consistent snapshots and publish writes of slave data under lock
+    void setWriteHandler( modbus_write_t handler ); //!<notify every range a master writes
+    void setChangeList( modbus_range_t *ranges, uint8_t u8ranges ); //!<record written ranges for getChange()
+    boolean getChange( modbus_range_t *range ); //!<oldest unread written range, false if none
+    boolean getChangeOverflow(); //!<ranges were lost since the last call: rescan
+    void setResponseCache( modbus_cache_t *entries, uint8_t u8entries ); //!<replay serialized FC1-FC4 answers until their data is written
+    void invalidateCache( uint8_t u8bank, uint16_t u16add, uint16_t u16count ); //!<application changed slave data outside a sequence lock
     void end(); //!<finish any communication and release serial communication port
 
     Modbus(uint8_t u8id=0, uint8_t u8serno=0, uint8_t u8txenpin=0) __attribute__((deprecated));
@@ -148,5 +283,27 @@ public:
     void begin(long u32speed = 19200) __attribute__((deprecated));
 };
 
+#define SCHED_NONE  0xFF //!< no telegram in flight
+
+class ModbusScheduler
+{
+private:
+    Modbus *master;
+    modbus_poll_t *apoll; //!< caller-owned poll list
+    uint8_t u8polls;
+    uint8_t u8current; //!< telegram in flight or SCHED_NONE
+    uint8_t u8next; //!< round-robin cursor
+    uint32_t u32cycleStart, u32cycleTime; //!< in us
+    uint16_t u16cycleCnt;
+    boolean bCycleBusy; //!< current pass issued at least one telegram
+
+public:
+    ModbusScheduler(Modbus &master, modbus_poll_t *polls, uint8_t u8polls);
+
+    int16_t run(); //!<cyclic poll; returns index of the telegram that just completed or -1
+    uint32_t getCycleTime(); //!<duration of the last full pass over the poll list in us
+    uint16_t getCycleCnt(); //!<number of completed passes
+};
+
 #endif // MODBUS_RTU_H
 
@@ -0,0 +1,140 @@
+#ifndef MODBUS_SEQ_H
+#define MODBUS_SEQ_H
+
+#include <stdint.h>
+#include <string.h>
+
+/* Sequence lock for register images shared between threads.
+ *
+ * Writers make the sequence odd while they update the image and even again
+ * when they are done; readers copy without locking and retry if the
+ * sequence was odd or moved under them. Readers never block writers and
+ * nobody takes a mutex. Writers serialise among themselves by spinning on
+ * the sequence, so keep write sections short and never enter one from an
+ * interrupt that may preempt another writer on the same core.
+ *
+ * Needs the GCC/Clang __atomic builtins. On AVR, where they would turn into
+ * libatomic calls that avr-libc does not provide, the sequence is read and
+ * changed with interrupts masked instead.
+ */
+typedef struct
+{
+    uint32_t u32seq;       /*!< even = stable, odd = write in progress */
+}
+modbus_seqlock_t;
+
+#define MODBUS_SEQLOCK_INIT { 0 }
+
+#if defined(__AVR__)
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+/* single core: masking interrupts makes each access atomic and a compiler
+ * barrier is all the ordering needed */
+#define MODBUS_SEQ_RELEASE() __asm__ __volatile__ ("" ::: "memory")
+#define MODBUS_SEQ_ACQUIRE() __asm__ __volatile__ ("" ::: "memory")
+
+static inline uint32_t ModbusSeq_load(const modbus_seqlock_t *lock)
+{
+    uint8_t u8sreg = SREG;
+    cli();
+    uint32_t u32seq = *(const volatile uint32_t *)&lock->u32seq;
+    SREG = u8sreg;
+    return u32seq;
+}
+
+/* move an even sequence to odd, fails if it changed since it was read */
+static inline int ModbusSeq_claim(modbus_seqlock_t *lock, uint32_t u32seq)
+{
+    int iClaimed = 0;
+    uint8_t u8sreg = SREG;
+    cli();
+    if (*(volatile uint32_t *)&lock->u32seq == u32seq)
+    {
+        *(volatile uint32_t *)&lock->u32seq = u32seq + 1;
+        iClaimed = 1;
+    }
+    SREG = u8sreg;
+    return iClaimed;
+}
+
+static inline void ModbusSeq_release(modbus_seqlock_t *lock)
+{
+    uint8_t u8sreg = SREG;
+    cli();
+    (*(volatile uint32_t *)&lock->u32seq)++;
+    SREG = u8sreg;
+}
+#else
+#define MODBUS_SEQ_RELEASE() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define MODBUS_SEQ_ACQUIRE() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+
+static inline uint32_t ModbusSeq_load(const modbus_seqlock_t *lock)
+{
+    return __atomic_load_n(&lock->u32seq, __ATOMIC_ACQUIRE);
+}
+
+/* move an even sequence to odd, fails if it changed since it was read */
+static inline int ModbusSeq_claim(modbus_seqlock_t *lock, uint32_t u32seq)
+{
+    return __atomic_compare_exchange_n(&lock->u32seq, &u32seq, u32seq + 1, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void ModbusSeq_release(modbus_seqlock_t *lock)
+{
+    __atomic_fetch_add(&lock->u32seq, 1, __ATOMIC_RELEASE);
+}
+#endif
+
+static inline void ModbusSeq_writeBegin(modbus_seqlock_t *lock)
+{
+    uint32_t u32seq;
+    do
+    {
+        u32seq = ModbusSeq_load(lock);
+    }
+    while ((u32seq & 1) != 0 || !ModbusSeq_claim(lock, u32seq));
+    MODBUS_SEQ_RELEASE(); /* odd sequence is visible before the data */
+}
+
+static inline void ModbusSeq_writeEnd(modbus_seqlock_t *lock)
+{
+    ModbusSeq_release(lock);
+}
+
+static inline uint32_t ModbusSeq_readBegin(const modbus_seqlock_t *lock)
+{
+    uint32_t u32seq;
+    while ((u32seq = ModbusSeq_load(lock)) & 1);
+    return u32seq;
+}
+
+/* non-zero if the data read since ModbusSeq_readBegin() may be torn */
+static inline int ModbusSeq_readRetry(const modbus_seqlock_t *lock, uint32_t u32seq)
+{
+    MODBUS_SEQ_ACQUIRE();
+    return ModbusSeq_load(lock) != u32seq;
+}
+
+/* publish u16count registers at once */
+static inline void ModbusSeq_write(modbus_seqlock_t *lock, uint16_t *au16dst, const uint16_t *au16src, uint16_t u16count)
+{
+    ModbusSeq_writeBegin(lock);
+    memcpy(au16dst, au16src, u16count * sizeof(uint16_t));
+    ModbusSeq_writeEnd(lock);
+}
+
+/* consistent snapshot of u16count registers */
+static inline void ModbusSeq_read(const modbus_seqlock_t *lock, uint16_t *au16dst, const uint16_t *au16src, uint16_t u16count)
+{
+    uint32_t u32seq;
+    do
+    {
+        u32seq = ModbusSeq_readBegin(lock);
+        memcpy(au16dst, au16src, u16count * sizeof(uint16_t));
+    }
+    while (ModbusSeq_readRetry(lock, u32seq));
+}
+
+#endif // MODBUS_SEQ_H
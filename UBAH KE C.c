@@ -1,5 +1,30 @@
 #include <stdint.h>
 #include "ModbusRtu.h"
+#include "ModbusCrc.h"
+#include "ModbusCore.h"
+
+static int8_t Modbus_process(Modbus* modbus, uint16_t *regs, uint8_t u8size);
+static bool Modbus_pollTx(Modbus* modbus);
+
+static void Modbus_dirPinTx(Modbus* modbus) {
+    if (modbus->u8txenpin > 1) digitalWrite(modbus->u8txenpin, HIGH);
+}
+
+static void Modbus_dirPinRx(Modbus* modbus) {
+    if (modbus->u8txenpin > 1) digitalWrite(modbus->u8txenpin, LOW);
+}
+
+static void Modbus_dirCallbackTx(Modbus* modbus) {
+    modbus->dirCallback(modbus, true);
+}
+
+static void Modbus_dirCallbackRx(Modbus* modbus) {
+    modbus->dirCallback(modbus, false);
+}
+
+const ModbusDir ModbusDir_none = { NULL, NULL };
+const ModbusDir ModbusDir_pin = { Modbus_dirPinTx, Modbus_dirPinRx };
+const ModbusDir ModbusDir_callback = { Modbus_dirCallbackTx, Modbus_dirCallbackRx };
 
 /* _____PUBLIC FUNCTIONS_____________________________________________________ */
 
@@ -16,8 +41,18 @@ void Modbus_init(Modbus* modbus, uint8_t u8id, Stream* port, uint8_t u8txenpin)
     modbus->port = port;
     modbus->u8id = u8id;
     modbus->u8txenpin = u8txenpin;
+    modbus->dir = &ModbusDir_pin;
+    modbus->bTxBusy = false;
+    modbus->u8state = COM_IDLE;
+    modbus->u8lastError = 0;
+    modbus->u8BufferSize = 0;
+    modbus->rx.u8state = RX_IDLE;
+    modbus->rx.u16expected = 0;
+    modbus->u16InCnt = modbus->u16OutCnt = modbus->u16errCnt = 0;
     modbus->u16timeOut = 1000;
     modbus->u32overTime = 0;
+    modbus->u32T35 = T35 * 1000UL;
+    modbus->u32char = modbus->u32T35 * 2 / 7;
 }
 
 /**
@@ -33,8 +68,12 @@ void Modbus_init(Modbus* modbus, uint8_t u8id, Stream* port, uint8_t u8txenpin)
 void Modbus_init_deprecated(Modbus* modbus, uint8_t u8id, uint8_t u8serno, uint8_t u8txenpin) {
     modbus->u8id = u8id;
     modbus->u8txenpin = u8txenpin;
+    modbus->dir = &ModbusDir_pin;
+    modbus->bTxBusy = false;
     modbus->u16timeOut = 1000;
     modbus->u32overTime = 0;
+    modbus->u32T35 = T35 * 1000UL;
+    modbus->u32char = modbus->u32T35 * 2 / 7;
 
     switch (u8serno) {
 #if defined(UBRR1H)
@@ -69,17 +108,34 @@ void Modbus_init_deprecated(Modbus* modbus, uint8_t u8id, uint8_t u8serno, uint8
  * @param modbus  Pointer to the Modbus object
  */
 void Modbus_start(Modbus* modbus) {
-    if (modbus->u8txenpin > 1) {   // pin 0 & pin 1 are reserved for RX/TX
-        // return RS485 transceiver to transmit mode
+    if (modbus->dir == &ModbusDir_pin && modbus->u8txenpin > 1) {   // pin 0 & pin 1 are reserved for RX/TX
         pinMode(modbus->u8txenpin, OUTPUT);
-        digitalWrite(modbus->u8txenpin, LOW);
     }
+    // return RS485 transceiver to receive mode
+    if (modbus->dir->receive != NULL) modbus->dir->receive(modbus);
+    modbus->bTxBusy = false;
 
     while (modbus->port->read() >= 0);
-    modbus->u8lastRec = modbus->u8BufferSize = 0;
+    modbus->u8BufferSize = 0;
+    modbus->rx.u8state = RX_IDLE;
+    modbus->rx.u16expected = 0;
     modbus->u16InCnt = modbus->u16OutCnt = modbus->u16errCnt = 0;
 }
 
+/**
+ * @brief
+ * Derive the T3.5 silence interval and the character time from the
+ * line speed in C. An RTU character is 11 bits long; above 19200 baud the
+ * fixed 1750 us value from the specification applies.
+ *
+ * @param modbus Pointer to the Modbus object
+ * @param u32speed baud rate, in standard increments (300..115200)
+ */
+void Modbus_setBaudRate(Modbus* modbus, long u32speed) {
+    if (u32speed <= 0) return;
+    ModbusCore_timing((uint32_t)u32speed, &modbus->u32T35, &modbus->u32char);
+}
+
 /**
  * @brief
  * Install a serial port, begin() it, and start ModbusRtu in C.
@@ -90,6 +146,7 @@ void Modbus_start(Modbus* modbus) {
 void Modbus_begin(Modbus* modbus, Stream* install_port, long u32speed) {
     modbus->port = install_port;
     install_port->begin(u32speed);
+    Modbus_setBaudRate(modbus, u32speed);
     Modbus_start(modbus);
 }
 
@@ -103,8 +160,10 @@ void Modbus_begin(Modbus* modbus, Stream* install_port, long u32speed) {
  */
 void Modbus_begin_with_txen(Modbus* modbus, Stream* install_port, long u32speed, uint8_t u8txenpin) {
     modbus->u8txenpin = u8txenpin;
+    modbus->dir = &ModbusDir_pin;
     modbus->port = install_port;
     install_port->begin(u32speed);
+    Modbus_setBaudRate(modbus, u32speed);
     Modbus_start(modbus);
 }
 
@@ -118,6 +177,7 @@ void Modbus_begin_with_txen(Modbus* modbus, Stream* install_port, long u32speed,
 void Modbus_begin_hw(Modbus* modbus, long u32speed) {
     // !!Can ONLY do this if port ACTUALLY IS a HardwareSerial object!!
     ((HardwareSerial*)modbus->port)->begin(u32speed);
+    Modbus_setBaudRate(modbus, u32speed);
     Modbus_start(modbus);
 }
 
@@ -136,15 +196,44 @@ void Modbus_setID(Modbus* modbus, uint8_t u8id) {
 
 /**
  * @brief
- * Method to write the overtime count for txend pin in C.
+ * Method to write the txend pin overtime in C.
+ * The line is held in transmit mode this long after the last stop bit.
  * 
  * @param modbus Pointer to the Modbus object
- * @param u32overTime count for txend pin
+ * @param u32overTime extra time in us
  */
 void Modbus_setTxendPinOverTime(Modbus* modbus, uint32_t u32overTime) {
     modbus->u32overTime = u32overTime;
 }
 
+/**
+ * @brief
+ * Drop the RS-485 direction control in C, e.g. for USB or RS-232.
+ * 
+ * @param modbus Pointer to the Modbus object
+ */
+void Modbus_setDirNone(Modbus* modbus) {
+    modbus->dir = &ModbusDir_none;
+}
+
+/**
+ * @brief
+ * Hand the RS-485 direction control to the application in C.
+ * The callback is called with true before a frame is sent and with
+ * false once its last stop bit and the overtime are out.
+ * 
+ * @param modbus Pointer to the Modbus object
+ * @param callback direction function, NULL for none
+ */
+void Modbus_setDirCallback(Modbus* modbus, void (*callback)(struct Modbus*, bool bTransmit)) {
+    if (callback == NULL) {
+        Modbus_setDirNone(modbus);
+        return;
+    }
+    modbus->dirCallback = callback;
+    modbus->dir = &ModbusDir_callback;
+}
+
 /**
  * @brief
  * Method to read current slave ID address in C.
@@ -167,6 +256,17 @@ void Modbus_setTimeOut(Modbus* modbus, uint16_t u16timeOut) {
     modbus->u16timeOut = u16timeOut;
 }
 
+/**
+ * @brief
+ * Return time-out parameter in C.
+ *
+ * @param modbus Pointer to the Modbus object
+ * @return time-out value (ms)
+ */
+uint16_t Modbus_getTimeOut(Modbus* modbus) {
+    return modbus->u16timeOut;
+}
+
 /**
  * @brief
  * Return communication Watchdog state in C.
@@ -241,79 +341,21 @@ uint8_t Modbus_getLastError(Modbus* modbus) {
  *
  * @param modbus Pointer to the Modbus object
  * @param telegram modbus telegram structure (id, fct, ...)
- * @return Status code (-3 for invalid ID, -2 for invalid Master ID, -1 for busy state, 0 for success)
+ * @return Status code (ERR_BAD_TELEGRAM for a telegram over the Modbus limits or too long for MAX_BUFFER, -3 for invalid ID, -2 for invalid Master ID, -1 for busy state, 0 for success)
  */
 int8_t Modbus_query(Modbus* modbus, modbus_t telegram) {
-    uint8_t u8regsno, u8bytesno;
     if (modbus->u8id != 0) return -2;
     if (modbus->u8state != COM_IDLE) return -1;
 
     if ((telegram.u8id == 0) || (telegram.u8id > 247)) return -3;
 
-    modbus->au16regs = telegram.au16reg;
-
-    // telegram header
-    modbus->au8Buffer[ID] = telegram.u8id;
-    modbus->au8Buffer[FUNC] = telegram.u8fct;
-    modbus->au8Buffer[ADD_HI] = highByte(telegram.u16RegAdd);
-    modbus->au8Buffer[ADD_LO] = lowByte(telegram.u16RegAdd);
-
-    switch (telegram.u8fct) {
-    case MB_FC_READ_COILS:
-    case MB_FC_READ_DISCRETE_INPUT:
-    case MB_FC_READ_REGISTERS:
-    case MB_FC_READ_INPUT_REGISTER:
-        modbus->au8Buffer[NB_HI] = highByte(telegram.u16CoilsNo);
-        modbus->au8Buffer[NB_LO] = lowByte(telegram.u16CoilsNo);
-        modbus->u8BufferSize = 6;
-        break;
-    case MB_FC_WRITE_COIL:
-        modbus->au8Buffer[NB_HI] = ((modbus->au16regs[0] > 0) ? 0xff : 0);
-        modbus->au8Buffer[NB_LO] = 0;
-        modbus->u8BufferSize = 6;
-        break;
-    case MB_FC_WRITE_REGISTER:
-        modbus->au8Buffer[NB_HI] = highByte(modbus->au16regs[0]);
-        modbus->au8Buffer[NB_LO] = lowByte(modbus->au16regs[0]);
-        modbus->u8BufferSize = 6;
-        break;
-    case MB_FC_WRITE_MULTIPLE_COILS: // TODO: implement "sending coils"
-        u8regsno = telegram.u16CoilsNo / 16;
-        u8bytesno = u8regsno * 2;
-        if ((telegram.u16CoilsNo % 16) != 0) {
-            u8bytesno++;
-            u8regsno++;
-        }
-
-        modbus->au8Buffer[NB_HI] = highByte(telegram.u16CoilsNo);
-        modbus->au8Buffer[NB_LO] = lowByte(telegram.u16CoilsNo);
-        modbus->au8Buffer[BYTE_CNT] = u8bytesno;
-        modbus->u8BufferSize = 7;
+    // telegram and the length of its answer come from the protocol core
+    int16_t i16length = ModbusCore_query(modbus->au8Buffer, MAX_BUFFER, &telegram, &modbus->rx.u16expected);
+    if (i16length < 0) return (int8_t)i16length;
 
-        for (uint16_t i = 0; i < u8bytesno; i++) {
-            if (i % 2) {
-                modbus->au8Buffer[modbus->u8BufferSize] = lowByte(modbus->au16regs[i / 2]);
-            } else {
-                modbus->au8Buffer[modbus->u8BufferSize] = highByte(modbus->au16regs[i / 2]);
-            }
-            modbus->u8BufferSize++;
-        }
-        break;
-
-    case MB_FC_WRITE_MULTIPLE_REGISTERS:
-        modbus->au8Buffer[NB_HI] = highByte(telegram.u16CoilsNo);
-        modbus->au8Buffer[NB_LO] = lowByte(telegram.u16CoilsNo);
-        modbus->au8Buffer[BYTE_CNT] = (uint8_t)(telegram.u16CoilsNo * 2);
-        modbus->u8BufferSize = 7;
-
-        for (uint16_t i = 0; i < telegram.u16CoilsNo; i++) {
-            modbus->au8Buffer[modbus->u8BufferSize] = highByte(modbus->au16regs[i]);
-            modbus->u8BufferSize++;
-            modbus->au8Buffer[modbus->u8BufferSize] = lowByte(modbus->au16regs[i]);
-            modbus->u8BufferSize++;
-        }
-        break;
-    }
+    modbus->au16regs = telegram.au16reg;
+    modbus->u16queryNo = telegram.u16CoilsNo;
+    modbus->u8BufferSize = (uint8_t)i16length;
 
     Modbus_sendTxBuffer(modbus);
     modbus->u8state = COM_WAITING;
@@ -332,35 +374,29 @@ int8_t Modbus_query(Modbus* modbus, modbus_t telegram) {
  * as defined in its modbus_t query telegram.
  *
  * @param modbus Pointer to the Modbus object
- * @return errors counter
+ * @return 0 while waiting, frame length once an answer is processed, < 0 for errors
  */
 int8_t Modbus_poll(Modbus* modbus) {
-    // check if there is any incoming frame
-    uint8_t u8current;
-    u8current = modbus->port->available();
+    // the query is still on the line
+    if (!Modbus_pollTx(modbus)) return 0;
 
-    if ((unsigned long)(millis() - modbus->u32timeOut) > (unsigned long)modbus->u16timeOut) {
+    // the time-out covers the slave turnaround; once the answer starts it ends on its own
+    if (modbus->u8state == COM_WAITING && modbus->rx.u8state == RX_IDLE && !modbus->port->available() &&
+        (unsigned long)(millis() - modbus->u32timeOut) > (unsigned long)modbus->u16timeOut) {
         modbus->u8state = COM_IDLE;
         modbus->u8lastError = NO_REPLY;
+        modbus->rx.u16expected = 0;
         modbus->u16errCnt++;
         return 0;
     }
 
-    if (u8current == 0) return 0;
-
-    // check T35 after frame end or still no frame end
-    if (u8current != modbus->u8lastRec) {
-        modbus->u8lastRec = u8current;
-        modbus->u32time = millis();
-        return 0;
-    }
-    if ((unsigned long)(millis() - modbus->u32time) < (unsigned long)T35) return 0;
-
-    // transfer Serial buffer frame to auBuffer
-    modbus->u8lastRec = 0;
+    // a predicted answer completes without waiting for T35
     int8_t i8state = Modbus_getRxBuffer(modbus);
-    if (i8state < 6) {
+    if (i8state == 0) return 0;
+    modbus->rx.u16expected = 0;
+    if (i8state < EXCEPTION_SIZE + CHECKSUM_SIZE) { // an exception answer is the shortest frame
         modbus->u8state = COM_IDLE;
+        modbus->u8lastError = (i8state < 0) ? (uint8_t)i8state : (uint8_t)ERR_BAD_SIZE;
         modbus->u16errCnt++;
         return i8state;
     }
@@ -369,31 +405,19 @@ int8_t Modbus_poll(Modbus* modbus) {
     uint8_t u8exception = Modbus_validateAnswer(modbus);
     if (u8exception != 0) {
         modbus->u8state = COM_IDLE;
-        return u8exception;
-    }
-
-    // process answer
-    switch (modbus->au8Buffer[FUNC]) {
-    case MB_FC_READ_COILS:
-    case MB_FC_READ_DISCRETE_INPUT:
-        Modbus_get_FC1(modbus);
-        break;
-    case MB_FC_READ_INPUT_REGISTER:
-    case MB_FC_READ_REGISTERS:
-        Modbus_get_FC3(modbus);
-        break;
-    case MB_FC_WRITE_COIL:
-    case MB_FC_WRITE_REGISTER:
-    case MB_FC_WRITE_MULTIPLE_COILS:
-    case MB_FC_WRITE_MULTIPLE_REGISTERS:
-        // Nothing to do
-        break;
-    default:
-        break;
+        modbus->u8lastError = u8exception;
+        return (int8_t)u8exception;
     }
 
+    // process answer: reads land in au16regs, sized by what was asked for
     modbus->u8state = COM_IDLE;
-    return 0;
+    int8_t i8answer = ModbusCore_getAnswer(modbus->au8Buffer, modbus->au16regs, modbus->u16queryNo);
+    if (i8answer != 0) {
+        modbus->u8lastError = (uint8_t)i8answer;
+        modbus->u16errCnt++;
+        return i8answer;
+    }
+    return (int8_t)modbus->u8BufferSize;
 }
 
 /**
@@ -414,25 +438,15 @@ int8_t Modbus_poll(Modbus* modbus) {
 int8_t Modbus_poll_slave(Modbus* modbus, uint16_t *regs, uint8_t u8size) {
     modbus->au16regs = regs;
     modbus->u8regsize = u8size;
-    uint8_t u8current;
 
-    // check if there is any incoming frame
-    u8current = modbus->port->available();
+    // the last answer is still on the line
+    if (!Modbus_pollTx(modbus)) return 0;
 
-    if (u8current == 0) return 0;
-
-    // check T35 after frame end or still no frame end
-    if (u8current != modbus->u8lastRec) {
-        modbus->u8lastRec = u8current;
-        modbus->u32time = millis();
-        return 0;
-    }
-    if ((unsigned long)(millis() - modbus->u32time) < (unsigned long)T35) return 0;
-
-    modbus->u8lastRec = 0;
+    // a request ends after T35 of silence behind its last byte
     int8_t i8state = Modbus_getRxBuffer(modbus);
+    if (i8state == 0) return 0;
     modbus->u8lastError = i8state;
-    if (i8state < 7) return i8state;
+    if (i8state < 2 + CHECKSUM_SIZE) return i8state; // ID and FUNC at least
 
     // check slave id
     if (modbus->au8Buffer[ID] != modbus->u8id) return 0;
@@ -452,99 +466,109 @@ int8_t Modbus_poll_slave(Modbus* modbus, uint16_t *regs, uint8_t u8size) {
     modbus->u8lastError = 0;
 
     // process message
-    switch (modbus->au8Buffer[FUNC]) {
-    case MB_FC_READ_COILS:
-    case MB_FC_READ_DISCRETE_INPUT:
-        return Modbus_process_FC1(modbus, regs, u8size);
-        break;
-    case MB_FC_READ_INPUT_REGISTER:
-    case MB_FC_READ_REGISTERS:
-        return Modbus_process_FC3(modbus, regs, u8size);
-        break;
-    case MB_FC_WRITE_COIL:
-        return Modbus_process_FC5(modbus, regs, u8size);
-        break;
-    case MB_FC_WRITE_REGISTER:
-        return Modbus_process_FC6(modbus, regs, u8size);
-        break;
-    case MB_FC_WRITE_MULTIPLE_COILS:
-        return Modbus_process_FC15(modbus, regs, u8size);
-        break;
-    case MB_FC_WRITE_MULTIPLE_REGISTERS:
-        return Modbus_process_FC16(modbus, regs, u8size);
-        break;
-    default:
-        break;
-    }
-    return i8state;
+    return Modbus_process(modbus, regs, u8size);
 }
 
 /* _____PRIVATE FUNCTIONS_____________________________________________________ */
 
+/**
+ * @brief
+ * Return the RS485 transceiver to receive mode in C once the frame being
+ * sent and the txend pin overtime are out, without blocking the loop.
+ *
+ * @param modbus Pointer to the Modbus object
+ * @return true when the line is free
+ */
+static bool Modbus_pollTx(Modbus* modbus) {
+    if (!modbus->bTxBusy) return true;
+    if ((unsigned long)(micros() - modbus->u32txStart) < (unsigned long)modbus->u32txTime) return false;
+
+    // the UART may still hold the last bytes
+    modbus->port->flush();
+    if (modbus->dir->receive != NULL) modbus->dir->receive(modbus);
+
+    // only an RS-485 transceiver echoes, and only our own frame; a late loop
+    // may already hold the start of the next frame behind it
+    bool bEcho = (modbus->dir == &ModbusDir_pin) ? (modbus->u8txenpin > 1) : (modbus->dir != &ModbusDir_none);
+    if (bEcho) {
+        for (uint8_t i = 0; i < modbus->u8txLength && modbus->port->available(); i++) modbus->port->read();
+    }
+    modbus->bTxBusy = false;
+
+    // T35 counts from the computed end of the frame, not from this poll
+    modbus->u32time = modbus->u32txStart + modbus->u32txTime;
+    return true;
+}
+
 /**
  * @brief
  * This function moves Serial buffer data to the Modbus au8Buffer in C.
+ * Bytes are added to the frame being received on every call; the frame
+ * ends as soon as a predicted answer is complete, or after T35 of silence.
  *
  * @param modbus Pointer to the Modbus object
- * @return buffer size if OK, ERR_BUFF_OVERFLOW if u8BufferSize >= MAX_BUFFER
+ * @return 0 while the frame is open, its size once complete, ERR_BUFF_OVERFLOW if it is longer than MAX_BUFFER
  */
 int8_t Modbus_getRxBuffer(Modbus* modbus) {
-    uint8_t bBuffOverflow = 0;
-
-    if (modbus->u8txenpin > 1) digitalWrite(modbus->u8txenpin, LOW);
+    uint32_t u32now = micros();
+
+    if (modbus->port->available()) {
+        if (modbus->rx.u8state == RX_IDLE) ModbusCore_rxBegin(&modbus->rx);
+
+        // the protocol core stores the frame and accumulates its CRC
+        while (modbus->port->available()) {
+            if (ModbusCore_rxByte(&modbus->rx, modbus->au8Buffer, MAX_BUFFER, modbus->port->read())) {
+                modbus->u8BufferSize = (uint8_t)modbus->rx.u16length;
+                modbus->u32time = u32now;
+                modbus->u16InCnt++;
+                return (int8_t)modbus->u8BufferSize;
+            }
+        }
+        modbus->u32time = u32now;
+        return 0;
+    }
 
-    modbus->u8BufferSize = 0;
-    while (modbus->port->available()) {
-        modbus->au8Buffer[modbus->u8BufferSize] = modbus->port->read();
-        modbus->u8BufferSize++;
+    // a frame ends after T35 of silence behind its last byte
+    if (modbus->rx.u8state == RX_IDLE) return 0;
+    if ((unsigned long)(u32now - modbus->u32time) < (unsigned long)modbus->u32T35) return 0;
 
-        if (modbus->u8BufferSize >= MAX_BUFFER) bBuffOverflow = 1;
-    }
+    int16_t i16length = ModbusCore_rxEnd(&modbus->rx);
+    modbus->u8BufferSize = (uint8_t)modbus->rx.u16length;
     modbus->u16InCnt++;
 
-    if (bBuffOverflow) {
+    if (i16length < 0) {
         modbus->u16errCnt++;
         return ERR_BUFF_OVERFLOW;
     }
-    return modbus->u8BufferSize;
+    return (int8_t)i16length;
 }
 
 /**
  * @brief
  * This function transmits au8Buffer to Serial line in C.
- * Only if u8txenpin != 0, there is a flow handling in order to keep
- * the RS485 transceiver in output state as long as the message is being sent.
+ * The direction backend keeps the RS485 transceiver in output state while
+ * the message is being sent; the line is released by Modbus_pollTx().
  * The CRC is appended to the buffer before starting to send it.
  *
  * @param modbus Pointer to the Modbus object
  */
 void Modbus_sendTxBuffer(Modbus* modbus) {
     // append CRC to message
-    uint16_t u16crc = Modbus_calcCRC(modbus, modbus->u8BufferSize);
-    modbus->au8Buffer[modbus->u8BufferSize] = u16crc >> 8;
-    modbus->u8BufferSize++;
-    modbus->au8Buffer[modbus->u8BufferSize] = u16crc & 0x00ff;
-    modbus->u8BufferSize++;
-
-    if (modbus->u8txenpin > 1) {
-        // set RS485 transceiver to transmit mode
-        digitalWrite(modbus->u8txenpin, HIGH);
-    }
+    modbus->u8BufferSize = (uint8_t)ModbusCore_seal(modbus->au8Buffer, modbus->u8BufferSize);
 
-    // transfer buffer to serial line
-    modbus->port->write(modbus->au8Buffer, modbus->u8BufferSize);
+    // set RS485 transceiver to transmit mode
+    if (modbus->dir->transmit != NULL) modbus->dir->transmit(modbus);
 
-    if (modbus->u8txenpin > 1) {
-        // must wait transmission end before changing pin state
-        modbus->port->flush();
-        // return RS485 transceiver to receive mode
-        volatile uint32_t u32overTimeCountDown = modbus->u32overTime;
-        while (u32overTimeCountDown-- > 0);
-        digitalWrite(modbus->u8txenpin, LOW);
-    }
-    while (modbus->port->read() >= 0);
+    // transfer buffer to serial line; the frame is out after one character time per byte
+    modbus->u32txStart = micros();
+    modbus->port->write(modbus->au8Buffer, modbus->u8BufferSize);
+    modbus->u32txTime = modbus->u8BufferSize * modbus->u32char + modbus->u32overTime;
+    modbus->u8txLength = modbus->u8BufferSize;
+    modbus->bTxBusy = true;
 
+    // a frame half received before the transmission is abandoned
     modbus->u8BufferSize = 0;
+    modbus->rx.u8state = RX_IDLE;
 
     // set time-out for master
     modbus->u32timeOut = millis();
@@ -562,21 +586,9 @@ void Modbus_sendTxBuffer(Modbus* modbus) {
  * @return uint16_t calculated CRC value for the message
  */
 uint16_t Modbus_calcCRC(Modbus* modbus, uint8_t u8length) {
-    unsigned int temp, temp2, flag;
-    temp = 0xFFFF;
-    for (unsigned char i = 0; i < u8length; i++) {
-        temp = temp ^ modbus->au8Buffer[i];
-        for (unsigned char j = 1; j <= 8; j++) {
-            flag = temp & 0x0001;
-            temp >>= 1;
-            if (flag) temp ^= 0xA001;
-        }
-    }
+    uint16_t u16crc = ModbusCRC_update(MODBUS_CRC_INIT, modbus->au8Buffer, u8length);
     // Reverse byte order.
-    temp2 = temp >> 8;
-    temp = (temp << 8) | temp2;
-    temp &= 0xFFFF;
-    return temp;
+    return (uint16_t)((u16crc << 8) | (u16crc >> 8));
 }
 
 /**
@@ -587,12 +599,102 @@ uint16_t Modbus_calcCRC(Modbus* modbus, uint8_t u8length) {
  * @return 0 if OK, EXCEPTION if anything fails
  */
 uint8_t Modbus_validateRequest(Modbus* modbus) {
-    // check message crc vs calculated crc
-    uint16_t u16MsgCRC = ((modbus->au8Buffer[modbus->u8BufferSize - 2] << 8) | modbus->au8Buffer[modbus->u8BufferSize - 1]);
-    if (Modbus_calcCRC(modbus, modbus->u8BufferSize - 2) != u16MsgCRC) {
+    // check accumulated crc: a sound frame leaves no residue
+    if (modbus->rx.u16crc != MODBUS_CRC_RESIDUE) {
         modbus->u16errCnt++;
         return NO_REPLY;
     }
-    return 0;
+
+    // function code, quantity and address against the register table
+    modbus_flat_t flat = { modbus->au16regs, modbus->u8regsize };
+    uint8_t u8exception = ModbusCore_checkRequest(&ModbusCore_flat, &flat, modbus->au8Buffer,
+                                                  modbus->u8BufferSize, MAX_BUFFER);
+    if (u8exception == EXC_FUNC_CODE || u8exception == NO_REPLY) modbus->u16errCnt++;
+    return u8exception;
+}
+
+/**
+ * @brief
+ * This function validates master incoming messages in C.
+ *
+ * @param modbus Pointer to the Modbus object
+ * @return 0 if OK, EXCEPTION if anything fails
+ */
+uint8_t Modbus_validateAnswer(Modbus* modbus) {
+    uint8_t u8exception = ModbusCore_checkAnswer(&modbus->rx, modbus->au8Buffer);
+    if (u8exception != 0) modbus->u16errCnt++;
+    return u8exception;
 }
 
+/**
+ * @brief
+ * This function builds an exception message in C.
+ *
+ * @param modbus Pointer to the Modbus object
+ * @param u8exception exception number
+ */
+void Modbus_buildException(Modbus* modbus, uint8_t u8exception) {
+    modbus->u8BufferSize = (uint8_t)ModbusCore_exception(modbus->au8Buffer, modbus->u8id, u8exception);
+}
+
+/**
+ * @brief
+ * This function copies an FC1/FC2 answer to the master register array in C.
+ *
+ * @param modbus Pointer to the Modbus object
+ */
+void Modbus_get_FC1(Modbus* modbus) {
+    ModbusCore_getAnswer(modbus->au8Buffer, modbus->au16regs, modbus->u16queryNo);
+}
+
+/**
+ * @brief
+ * This function copies an FC3/FC4 answer to the master register array in C.
+ *
+ * @param modbus Pointer to the Modbus object
+ */
+void Modbus_get_FC3(Modbus* modbus) {
+    ModbusCore_getAnswer(modbus->au8Buffer, modbus->au16regs, modbus->u16queryNo);
+}
+
+/**
+ * @brief
+ * This function answers a validated request from the register table in C.
+ * The protocol core builds the answer in au8Buffer; it is sent right away.
+ *
+ * @param modbus Pointer to the Modbus object
+ * @param regs register table for communication exchange
+ * @param u8size size of the register table
+ * @return u8BufferSize Response to master length
+ */
+static int8_t Modbus_process(Modbus* modbus, uint16_t *regs, uint8_t u8size) {
+    modbus_flat_t flat = { regs, u8size };
+    modbus->u8BufferSize = (uint8_t)ModbusCore_process(&ModbusCore_flat, &flat, modbus->au8Buffer);
+    int8_t i8answer = (int8_t)(modbus->u8BufferSize + CHECKSUM_SIZE);
+    Modbus_sendTxBuffer(modbus);
+    return i8answer;
+}
+
+int8_t Modbus_process_FC1(Modbus* modbus, uint16_t *regs, uint8_t u8size) {
+    return Modbus_process(modbus, regs, u8size);
+}
+
+int8_t Modbus_process_FC3(Modbus* modbus, uint16_t *regs, uint8_t u8size) {
+    return Modbus_process(modbus, regs, u8size);
+}
+
+int8_t Modbus_process_FC5(Modbus* modbus, uint16_t *regs, uint8_t u8size) {
+    return Modbus_process(modbus, regs, u8size);
+}
+
+int8_t Modbus_process_FC6(Modbus* modbus, uint16_t *regs, uint8_t u8size) {
+    return Modbus_process(modbus, regs, u8size);
+}
+
+int8_t Modbus_process_FC15(Modbus* modbus, uint16_t *regs, uint8_t u8size) {
+    return Modbus_process(modbus, regs, u8size);
+}
+
+int8_t Modbus_process_FC16(Modbus* modbus, uint16_t *regs, uint8_t u8size) {
+    return Modbus_process(modbus, regs, u8size);
+}
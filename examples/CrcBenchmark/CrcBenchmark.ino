@@ -0,0 +1,51 @@
+/**
+ *  CRC-16/Modbus strategy benchmark
+ *
+ *  Runs every CRC strategy from ModbusCrc.h over a full 256 byte ADU and
+ *  prints the cost in ns/byte on the serial monitor. The strategy used by
+ *  the library itself is picked with MODBUS_CRC_STRATEGY at compile time.
+ */
+
+#include <ModbusRtu.h>
+#include <ModbusCrc.h>
+
+#define BENCH_FRAME  256
+#define BENCH_LOOPS  200
+
+typedef uint16_t (*crc_fn_t)(uint16_t u16crc, const uint8_t *au8data, uint16_t u16length);
+
+uint8_t au8frame[ BENCH_FRAME ];
+volatile uint16_t u16sink;
+
+void bench( const char *name, crc_fn_t fn )
+{
+  uint32_t u32start = micros();
+  for (uint16_t i = 0; i < BENCH_LOOPS; i++)
+  {
+    u16sink = fn( MODBUS_CRC_INIT, au8frame, BENCH_FRAME );
+  }
+  uint32_t u32elapsed = micros() - u32start;
+
+  Serial.print( name );
+  Serial.print( F(": ") );
+  Serial.print( (float)u32elapsed * 1000.0 / ((uint32_t)BENCH_LOOPS * BENCH_FRAME) );
+  Serial.print( F(" ns/byte, crc=0x") );
+  Serial.println( u16sink, HEX );
+}
+
+void setup()
+{
+  Serial.begin( 115200 );
+  for (uint16_t i = 0; i < BENCH_FRAME; i++) au8frame[ i ] = (uint8_t)(i * 37 + 11);
+
+  Serial.print( F("selected strategy: ") );
+  Serial.println( MODBUS_CRC_STRATEGY );
+  bench( "bitwise", ModbusCRC_bitwise );
+  bench( "nibble ", ModbusCRC_nibble );
+  bench( "table  ", ModbusCRC_table );
+  bench( "slice8 ", ModbusCRC_slice8 );
+}
+
+void loop()
+{
+}